@@ -20,40 +20,39 @@
 #ifndef ALIGNMENT_3N_TABLE_H
 #define ALIGNMENT_3N_TABLE_H
 
+#include "contig_3n_table.h"
+#include "policy_3n_table.h"
+#include "tokenizer_3n_table.h"
 #include "utility_3n_table.h"
 #include <string>
 
-extern bool uniqueOnly;
-extern bool multipleOnly;
-
 using namespace std;
 
 /**
- * the class to store information from one SAM line
+ * the class to store information from one SAM line. the dictionary of
+ * contigCache must be set to parse a line.
  */
 class Alignment {
   public:
-    string chromosome;
+    int contig; // the id in ContigDictionary, -1 if the read is not placed.
     long long int location;
     long long int mateLocation;
     int flag;
     bool mapped;
     char strand;
     string sequence;
-    string quality;
     bool unique;
-    string mapQ;
     int NH;
-    vector<PosQuality> bases;
     CIGAR cigarString;
     MD_tag MD;
-    unsigned long long readNameID;
-    int sequenceCoveredLength; // the sum of number is cigarString;
+    int sequenceCoveredLength; // the bp of reference covered by cigarString.
     bool overlap; // if the segment could overlap with the mate segment.
     bool paired;
+    SAMTokenizer lineTokenizer; // to parse a single line.
+    ContigCache contigCache;    // to find the contig of RNAME.
 
     void initialize() {
-        chromosome.clear();
+        contig = -1;
         location = -1;
         mateLocation = -1;
         flag = -1;
@@ -61,12 +60,8 @@ class Alignment {
         MD.initialize();
         cigarString.initialize();
         sequence.clear();
-        quality.clear();
         unique = false;
-        mapQ.clear();
         NH = -1;
-        bases.clear();
-        readNameID = 0;
         sequenceCoveredLength = 0;
         overlap = false;
         paired = false;
@@ -76,9 +71,10 @@ class Alignment {
      * for start position in input Line, check if it contain the target
      * information.
      */
-    bool startWith(string inputLine, int startPosition, string tag) {
-        for (int i = 0; i < tag.size(); i++) {
-            if (inputLine.at(startPosition + i) != tag[i]) {
+    static inline bool startWith(const char *field, const char *end,
+                                 const char *tag) {
+        for (int i = 0; tag[i] != '\0'; i++) {
+            if (field + i >= end || field[i] != tag[i]) {
                 return false;
             }
         }
@@ -86,82 +82,65 @@ class Alignment {
     }
 
     /**
-     * generate a hash value for readName
+     * return true if the read is not counted by any table (u|m mode).
      */
-    void getNameHash(string &readName) {
-        readNameID = 0;
-        int a = 63689;
-        for (size_t i = 0; i < readName.size(); i++) {
-            readNameID = (readNameID * a) + (int)readName[i];
-        }
+    template <typename Policy> inline bool isFiltered() {
+        return !Policy::counts(unique);
     }
 
     /**
-     * extract the information from SAM line to Alignment.
+     * extract the information from SAM line to Alignment, with the ends of
+     * its fields from SAMTokenizer, without copying the line. the fields
+     * after CIGAR are only decoded if the bases of the read are needed. return
+     * false if the SAM line is unmapped (or broken), then the line should be
+     * skipped.
      */
-    void parseInfo(string line) {
-        int startPosition = 0;
-        int endPosition = 0;
-        int count = 0;
-
-        while (true) {
-
-            endPosition = line.find("\t", startPosition);
-            if (endPosition == string::npos) {
-                endPosition = line.size();
-            }
+    template <typename Policy>
+    bool parseInfo(const char *line, const uint32_t *fieldEnds, int nFields) {
+        if (nFields <= 4) {
+            return false;
+        }
+        for (int count = 0; count < nFields; count++) {
+            const char *start = count == 0 ? line : line + fieldEnds[count - 1] + 1;
+            const char *fieldEnd = line + fieldEnds[count];
 
-            if (count == 0) {
-                string readName =
-                    line.substr(startPosition, endPosition - startPosition);
-                getNameHash(readName);
-            } else if (count == 1) {
-                flag = stoi(
-                    line.substr(startPosition, endPosition - startPosition));
+            if (count == 1) {
+                flag = (int)parseInteger(start, fieldEnd);
                 mapped = (flag & 4) == 0;
                 paired = (flag & 1) != 0;
             } else if (count == 2) {
-                chromosome =
-                    line.substr(startPosition, endPosition - startPosition);
+                if (fieldEnd - start != 1 || *start != '*') {
+                    contig = contigCache.get(start, fieldEnd - start);
+                }
             } else if (count == 3) {
-                location = stoll(
-                    line.substr(startPosition, endPosition - startPosition));
-            } else if (count == 4) {
-                mapQ = line.substr(startPosition, endPosition - startPosition);
-                if (mapQ == "1") {
-                    unique = false;
-                } else {
-                    unique = true;
+                location = parseInteger(start, fieldEnd);
+                if (contig < 0) {
+                    return false;
                 }
+            } else if (count == 4) {
+                unique = !(fieldEnd - start == 1 && *start == '1');
             } else if (count == 5) {
-                cigarString.loadString(
-                    line.substr(startPosition, endPosition - startPosition));
+                // the CIGAR is loaded for every read, as from BAM, so
+                // --regions checks the same span for both.
+                cigarString.loadString(start, fieldEnd - start);
+                if (!mapped || isFiltered<Policy>()) {
+                    return true;
+                }
             } else if (count == 7) {
-                mateLocation = stoll(
-                    line.substr(startPosition, endPosition - startPosition));
+                mateLocation = parseInteger(start, fieldEnd);
             } else if (count == 9) {
-                sequence =
-                    line.substr(startPosition, endPosition - startPosition);
-            } else if (count == 10) {
-                quality =
-                    line.substr(startPosition, endPosition - startPosition);
+                sequence.assign(start, fieldEnd - start);
             } else if (count > 10) {
-                if (startWith(line, startPosition, "MD")) {
-                    MD.loadString(line.substr(startPosition + 5,
-                                              endPosition - startPosition - 5));
-                } else if (startWith(line, startPosition, "NM")) {
-                    NH = stoi(line.substr(startPosition + 5,
-                                          endPosition - startPosition - 5));
-                } else if (startWith(line, startPosition, "YZ")) {
-                    strand = line.at(endPosition - 1);
+                if (startWith(start, fieldEnd, "MD")) {
+                    MD.loadString(start + 5, fieldEnd - start - 5);
+                } else if (startWith(start, fieldEnd, "NM")) {
+                    NH = (int)parseInteger(start + 5, fieldEnd);
+                } else if (startWith(start, fieldEnd, "YZ")) {
+                    strand = *(fieldEnd - 1);
                 }
             }
-            if (endPosition == line.size()) {
-                break;
-            }
-            startPosition = endPosition + 1;
-            count++;
         }
+        return true;
     }
 
     /**
@@ -181,120 +160,93 @@ class Alignment {
     }
 
     /**
-     * parse the sam line to alignment information
+     * parse the sam line, tokenized by SAMTokenizer, to alignment
+     * information. return false if the line is unmapped.
      */
-    void parse(string line) {
+    template <typename Policy>
+    bool parse(const char *line, const uint32_t *fieldEnds, int nFields) {
         initialize();
-        parseInfo(line);
-        if ((uniqueOnly && !unique) || (multipleOnly && unique)) {
-            return;
-        }
-        appendBase();
+        return parseInfo<Policy>(line, fieldEnds, nFields);
     }
 
     /**
-     *  scan all base in read sequence label them if they are qualified.
+     * parse one sam line of length, with or without the newline.
      */
-    void appendBase() {
-        if (!mapped ||
-            sequenceCoveredLength > 500000) { // if the read's intron longer
-                                              // than 500,000 ignore this read
-            return;
-        }
-
-        bases.reserve(sequence.size());
-        for (int i = 0; i < sequence.size(); i++) {
-            bases.emplace_back(i);
-        }
-        int pos = adjustPos();
-
-        string match;
-        while (MD.getNextSegment(match)) {
-            if (isdigit(match.front())) { // the first char of match is digit
-                                          // this is match
-                int len = stoi(match);
-                for (int i = 0; i < len; i++) {
-                    while (bases[pos].remove) {
-                        pos++;
-                    }
-                    if ((strand == '+' && sequence[pos] == convertFrom) ||
-                        (strand == '-' &&
-                         sequence[pos] == convertFromComplement)) {
-                        bases[pos].setQual(quality[pos], false);
-                    } else {
-                        bases[pos].remove = true;
-                    }
-                    pos++;
-                }
-            } else if (isalpha(
-                           match.front())) { // this is mismatch or conversion
-                char refBase = match.front();
-                // for + strand, it should have C->T change
-                // for - strand, it should have G->A change
-                while (bases[pos].remove) {
-                    pos++;
-                }
-
-                if ((strand == '+' && refBase == convertFrom &&
-                     sequence[pos] == convertTo) ||
-                    (strand == '-' && refBase == convertFromComplement &&
-                     sequence[pos] == convertToComplement)) {
-                    bases[pos].setQual(quality[pos], true);
-                } else {
-                    bases[pos].remove = true;
-                }
-                pos++;
-            } else { // deletion. do nothing.
-            }
+    template <typename Policy> bool parse(const char *line, int length) {
+        lineTokenizer.tokenize(line, length);
+        if (lineTokenizer.records.empty()) {
+            initialize();
+            return false;
         }
+        const SAMRecordView &record = lineTokenizer.records[0];
+        return parse<Policy>(line, lineTokenizer.fieldEnds.data(), record.nFields);
     }
 
     /**
-     * adjust the reference position in bases
+     * walk the CIGAR operations and the MD tag together, and call
+     * sink(refPos, converted) for each qualified base of the read. refPos is
+     * 0-based from location. the read is skipped if it is not selected by
+     * u|m mode, or if it covers more than maxCoveredLength bp (with the
+     * intron). '=' and 'X' are aligned bases like 'M'. the conversion and
+     * the selection are fixed by Policy at compile time.
      */
-    int adjustPos() {
-
-        int readPos = 0;
-        int returnPos = 0;
+    template <typename Policy, typename Sink> void scanBases(Sink &&sink) {
+        if (!mapped || isFiltered<Policy>()) {
+            return;
+        }
+        long long int coveredLength = cigarString.getCoveredLength();
+        sequenceCoveredLength = min(coveredLength, (long long int)inf);
+        if (coveredLength > maxCoveredLength) {
+            return;
+        }
         int seqLength = sequence.size();
+        int readPos = 0;
+        int refPos = 0;
+        bool mdEnd = false;
+        // the change of the read strand, the complements on - strand.
+        char from = strand == '+' ? Policy::from()
+                    : strand == '-' ? Policy::fromComplement() : '\0';
+        char to = strand == '+' ? Policy::to() : Policy::toComplement();
 
         char cigarSymbol;
         int cigarLen;
-        sequenceCoveredLength = 0;
-
         while (cigarString.getNextSegment(cigarLen, cigarSymbol)) {
-            sequenceCoveredLength += cigarLen;
-            if (cigarSymbol == 'S') {
-                if (readPos == 0) { // soft clip is at the begin of the read
-                    returnPos = cigarLen;
-                    for (int i = cigarLen; i < seqLength; i++) {
-                        bases[i].refPos -= cigarLen;
+            if (cigarSymbol == 'M' || cigarSymbol == '=' || cigarSymbol == 'X') {
+                int len = min(cigarLen, seqLength - readPos);
+                for (int i = 0; i < len && !mdEnd; i++) {
+                    char refBase;
+                    int match = MD.getNextBase(refBase);
+                    char base = sequence[readPos + i];
+                    if (match < 0) {
+                        mdEnd = true;
+                    } else if (match) {
+                        if (base == from) {
+                            sink(refPos + i, false);
+                        }
+                    } else if (refBase == from && base == to) {
+                        // for + strand, it should have C->T change
+                        // for - strand, it should have G->A change
+                        sink(refPos + i, true);
                     }
-                } else { // soft clip is at the end of the read
-                    // do nothing
-                }
-                readPos += cigarLen;
-            } else if (cigarSymbol == 'N') {
-                for (int i = readPos; i < seqLength; i++) {
-                    bases[i].refPos += cigarLen;
-                }
-            } else if (cigarSymbol == 'M') {
-                for (int i = readPos; i < readPos + cigarLen; i++) {
-                    bases[i].remove = false;
                 }
                 readPos += cigarLen;
-            } else if (cigarSymbol == 'I') {
-                for (int i = readPos + cigarLen; i < seqLength; i++) {
-                    bases[i].refPos -= cigarLen;
-                }
+                refPos += cigarLen;
+            } else if (cigarSymbol == 'S' || cigarSymbol == 'I') {
                 readPos += cigarLen;
-            } else if (cigarSymbol == 'D') {
-                for (int i = readPos; i < seqLength; i++) {
-                    bases[i].refPos += cigarLen;
-                }
+            } else if (cigarSymbol == 'N' || cigarSymbol == 'D') {
+                refPos += cigarLen;
             }
         }
-        return returnPos;
+    }
+
+    /**
+     * collect the qualified bases as counting events. call it after parse().
+     */
+    template <typename Policy>
+    void getIncrements(vector<PosIncrement> &increments) {
+        scanBases<Policy>([&increments](int refPos, bool converted) {
+            increments.emplace_back(refPos, converted);
+        });
     }
 };
 
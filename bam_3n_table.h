@@ -0,0 +1,850 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BAM_3N_TABLE_H
+#define BAM_3N_TABLE_H
+
+#include "alignment_3n_table.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+
+using namespace std;
+
+const int bgzfBlockHeaderSize = 18;
+const int bgzfMaxBlockSize = 65536;
+
+/**
+ * read the little-endian integers in BAM data.
+ */
+inline int32_t readInt32(const char *p) {
+    int32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint32_t readUInt32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+inline uint16_t readUInt16(const char *p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return v;
+}
+
+/**
+ * read one BGZF block (header and compressed data) from file to buffer, which
+ * has bgzfMaxBlockSize bytes. return the block size, or 0 at the end of file.
+ */
+inline int readBGZFBlock(FILE *file, char *buffer) {
+    unsigned char *header = (unsigned char *)buffer;
+    size_t n = fread(header, 1, bgzfBlockHeaderSize, file);
+    if (n == 0) {
+        return 0;
+    }
+    if (n != bgzfBlockHeaderSize || header[0] != 31 || header[1] != 139 ||
+        header[2] != 8 || (header[3] & 4) == 0) {
+        cerr << "The alignment file is not a valid BGZF (BAM) file." << endl;
+        throw 1;
+    }
+    // BSIZE is in the 'BC' extra subfield. HISAT-3N only needs the first
+    // subfield, which is how BGZF writers place it.
+    int blockSize = readUInt16(buffer + 16) + 1;
+    if (blockSize <= bgzfBlockHeaderSize + 8 || blockSize > bgzfMaxBlockSize) {
+        cerr << "The alignment file has a broken BGZF block." << endl;
+        throw 1;
+    }
+    if (fread(buffer + bgzfBlockHeaderSize, 1, blockSize - bgzfBlockHeaderSize,
+              file) != (size_t)(blockSize - bgzfBlockHeaderSize)) {
+        cerr << "The alignment file is truncated." << endl;
+        throw 1;
+    }
+    return blockSize;
+}
+
+/**
+ * inflate one complete BGZF block of size blockSize to output, which has
+ * bgzfMaxBlockSize bytes. return the length of uncompressed data.
+ */
+inline int inflateBGZFBlock(z_stream &stream, const char *input, int blockSize,
+                            char *output) {
+    int length = readInt32(input + blockSize - 4);
+    inflateReset(&stream);
+    stream.next_in = (Bytef *)(input + bgzfBlockHeaderSize);
+    stream.avail_in = blockSize - bgzfBlockHeaderSize - 8;
+    stream.next_out = (Bytef *)output;
+    stream.avail_out = bgzfMaxBlockSize;
+    int ret = inflate(&stream, Z_FINISH);
+    if (ret != Z_STREAM_END || (int)stream.total_out != length) {
+        cerr << "Cannot decompress the BGZF block in alignment file." << endl;
+        throw 1;
+    }
+    return length;
+}
+
+/**
+ * open the alignment file, or use standard input if fileName is empty or -.
+ */
+inline FILE *openAlignmentFile(const string &fileName, const char *mode) {
+    if (fileName.empty() || fileName == "-") {
+        return stdin;
+    }
+    FILE *file = fopen(fileName.c_str(), mode);
+    if (file == NULL) {
+        cerr << "Cannot open the alignment file: " << fileName << endl;
+        throw 1;
+    }
+    return file;
+}
+
+/**
+ * return true if the next byte in file is the start of a BGZF (BAM) file.
+ */
+inline bool isBGZF(FILE *file) {
+    int c = getc(file);
+    if (c == EOF) {
+        return false;
+    }
+    ungetc(c, file);
+    return c == 31;
+}
+
+/**
+ * sequential reader for BGZF compressed file. it can seek to a virtual
+ * offset (compressed block address << 16 | offset in block) from BAM index.
+ */
+class BGZFReader {
+  private:
+    FILE *file;
+    bool ownFile;
+    z_stream stream;
+    vector<char> compressed;
+    vector<char> block;
+    int blockLength;
+    int blockOffset;
+    uint64_t blockAddress; // the file offset of block.
+
+    /**
+     * read and inflate the next BGZF block. return false at end of file.
+     */
+    bool readBlock() {
+        blockOffset = 0;
+        blockLength = 0;
+        blockAddress = ftello(file);
+        int blockSize = readBGZFBlock(file, compressed.data());
+        if (blockSize == 0) {
+            return false;
+        }
+        blockLength =
+            inflateBGZFBlock(stream, compressed.data(), blockSize, block.data());
+        return true;
+    }
+
+  public:
+    BGZFReader() : file(NULL), ownFile(false), compressed(bgzfMaxBlockSize),
+                   block(bgzfMaxBlockSize) {
+        memset(&stream, 0, sizeof(stream));
+        inflateInit2(&stream, -15);
+        blockLength = blockOffset = 0;
+        blockAddress = 0;
+    }
+
+    ~BGZFReader() {
+        close();
+        inflateEnd(&stream);
+    }
+
+    void open(const string &fileName) {
+        close();
+        file = openAlignmentFile(fileName, "rb");
+        ownFile = file != stdin;
+        blockLength = blockOffset = 0;
+    }
+
+    /**
+     * read from a file which is already open, e.g. standard input.
+     */
+    void open(FILE *inputFile) {
+        close();
+        file = inputFile;
+        ownFile = false;
+        blockLength = blockOffset = 0;
+    }
+
+    void close() {
+        if (file != NULL && ownFile) {
+            fclose(file);
+        }
+        file = NULL;
+    }
+
+    /**
+     * move to the virtual offset from BAM index.
+     */
+    void seek(uint64_t virtualOffset) {
+        if (fseeko(file, virtualOffset >> 16, SEEK_SET) != 0) {
+            cerr << "Cannot seek in the alignment file." << endl;
+            throw 1;
+        }
+        readBlock();
+        blockOffset = virtualOffset & 0xffff;
+    }
+
+    /**
+     * the virtual offset of the next byte, to seek back to it later.
+     */
+    uint64_t tell() {
+        if (blockOffset == blockLength) {
+            return (uint64_t)ftello(file) << 16;
+        }
+        return blockAddress << 16 | blockOffset;
+    }
+
+    /**
+     * read n bytes to output. return false if the file ends before any byte
+     * is read. throw if the file ends in the middle.
+     */
+    bool read(char *output, int n) {
+        int copied = 0;
+        while (copied < n) {
+            if (blockOffset == blockLength) {
+                if (!readBlock()) {
+                    if (copied == 0) {
+                        return false;
+                    }
+                    cerr << "The alignment file is truncated." << endl;
+                    throw 1;
+                }
+                continue;
+            }
+            int len = min(n - copied, blockLength - blockOffset);
+            memcpy(output + copied, block.data() + blockOffset, len);
+            blockOffset += len;
+            copied += len;
+        }
+        return true;
+    }
+};
+
+const int bgzfChunkBlockCount = 64;
+
+/**
+ * BGZF blocks read and inflated together by ParallelBGZFReader.
+ */
+class BGZFChunk {
+  public:
+    long long int id = 0;
+    int nBlocks = 0;
+    vector<char> compressed;
+    vector<int> blockSizes;
+    vector<char> data;
+    int dataLength = 0;
+
+    BGZFChunk()
+        : compressed(bgzfChunkBlockCount * bgzfMaxBlockSize),
+          blockSizes(bgzfChunkBlockCount),
+          data(bgzfChunkBlockCount * bgzfMaxBlockSize) {}
+};
+
+/**
+ * sequential reader for BGZF compressed stream (file or standard input). one
+ * thread reads the compressed blocks, nThreads threads inflate them, and
+ * read() returns the data in the original order.
+ */
+class ParallelBGZFReader {
+  private:
+    FILE *file;
+    bool ownFile;
+    int nThreads;
+    vector<BGZFChunk> chunks;
+    SafeQueue<BGZFChunk *> freeChunks;
+    SafeQueue<BGZFChunk *> inflateQueue;
+    SafeQueue<BGZFChunk *> doneQueue;
+    vector<thread> threads;
+    mutex threadMutex;
+    int runningInflaters;
+    exception_ptr threadException;
+
+    map<long long int, BGZFChunk *> pending;
+    long long int nextId;
+    BGZFChunk *current;
+    int currentOffset;
+
+    void fail() {
+        lock_guard<mutex> lock(threadMutex);
+        if (!threadException) {
+            threadException = current_exception();
+        }
+        freeChunks.close();
+        inflateQueue.close();
+        doneQueue.close();
+    }
+
+    void readChunks() {
+        try {
+            long long int id = 0;
+            BGZFChunk *chunk;
+            bool eof = false;
+            while (!eof && freeChunks.popFront(chunk)) {
+                chunk->id = id++;
+                chunk->nBlocks = 0;
+                char *buffer = chunk->compressed.data();
+                while (chunk->nBlocks < bgzfChunkBlockCount) {
+                    int blockSize = readBGZFBlock(
+                        file, buffer + chunk->nBlocks * bgzfMaxBlockSize);
+                    if (blockSize == 0) {
+                        eof = true;
+                        break;
+                    }
+                    chunk->blockSizes[chunk->nBlocks++] = blockSize;
+                }
+                inflateQueue.push(chunk);
+            }
+        } catch (...) {
+            fail();
+        }
+        inflateQueue.close();
+    }
+
+    void inflateChunks() {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        inflateInit2(&stream, -15);
+        try {
+            BGZFChunk *chunk;
+            while (inflateQueue.popFront(chunk)) {
+                chunk->dataLength = 0;
+                for (int i = 0; i < chunk->nBlocks; i++) {
+                    chunk->dataLength += inflateBGZFBlock(
+                        stream, chunk->compressed.data() + i * bgzfMaxBlockSize,
+                        chunk->blockSizes[i],
+                        chunk->data.data() + chunk->dataLength);
+                }
+                doneQueue.push(chunk);
+            }
+        } catch (...) {
+            fail();
+        }
+        inflateEnd(&stream);
+        lock_guard<mutex> lock(threadMutex);
+        if (--runningInflaters == 0) {
+            doneQueue.close();
+        }
+    }
+
+    /**
+     * move to the next inflated chunk in order. return false at end of file.
+     */
+    bool nextChunk() {
+        if (current != NULL) {
+            freeChunks.push(current);
+            current = NULL;
+        }
+        while (true) {
+            map<long long int, BGZFChunk *>::iterator it = pending.find(nextId);
+            if (it != pending.end()) {
+                current = it->second;
+                currentOffset = 0;
+                pending.erase(it);
+                nextId++;
+                return true;
+            }
+            BGZFChunk *chunk;
+            if (!doneQueue.popFront(chunk)) {
+                if (threadException) {
+                    rethrow_exception(threadException);
+                }
+                return false;
+            }
+            pending[chunk->id] = chunk;
+        }
+    }
+
+  public:
+    ParallelBGZFReader(int inputNThreads)
+        : file(NULL), ownFile(false), nThreads(inputNThreads),
+          chunks(inputNThreads * 2 + 2), runningInflaters(0), nextId(0),
+          current(NULL), currentOffset(0) {}
+
+    ~ParallelBGZFReader() { close(); }
+
+    /**
+     * start reading fileName, or standard input if fileName is empty.
+     */
+    void open(const string &fileName) {
+        open(openAlignmentFile(fileName, "rb"));
+        ownFile = file != stdin;
+    }
+
+    /**
+     * start reading a file which is already open, e.g. standard input.
+     */
+    void open(FILE *inputFile) {
+        file = inputFile;
+        ownFile = false;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            freeChunks.push(&chunks[i]);
+        }
+        runningInflaters = nThreads;
+        threads.emplace_back(&ParallelBGZFReader::readChunks, this);
+        for (int i = 0; i < nThreads; i++) {
+            threads.emplace_back(&ParallelBGZFReader::inflateChunks, this);
+        }
+    }
+
+    void close() {
+        freeChunks.close();
+        inflateQueue.close();
+        doneQueue.close();
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        threads.clear();
+        if (file != NULL && ownFile) {
+            fclose(file);
+        }
+        file = NULL;
+    }
+
+    /**
+     * read n bytes to output. return false if the file ends before any byte
+     * is read. throw if the file ends in the middle.
+     */
+    bool read(char *output, int n) {
+        int copied = 0;
+        while (copied < n) {
+            if (current == NULL || currentOffset == current->dataLength) {
+                if (!nextChunk()) {
+                    if (copied == 0) {
+                        return false;
+                    }
+                    cerr << "The alignment file is truncated." << endl;
+                    throw 1;
+                }
+                continue;
+            }
+            int len = min(n - copied, current->dataLength - currentOffset);
+            memcpy(output + copied, current->data.data() + currentOffset, len);
+            currentOffset += len;
+            copied += len;
+        }
+        return true;
+    }
+};
+
+/**
+ * the references listed in BAM header.
+ */
+class BAMHeader {
+  public:
+    vector<string> names;
+    vector<long long int> lengths;
+    vector<int> contigs; // the id in ContigDictionary, -1 if not in reference.
+
+    /**
+     * check the references against the reference file and find their ids.
+     */
+    void setContigs(const ContigDictionary &dictionary) {
+        contigs.resize(names.size());
+        for (size_t i = 0; i < names.size(); i++) {
+            contigs[i] = dictionary.check(names[i], lengths[i]);
+        }
+    }
+
+    /**
+     * the id of reference ref, throw if it is not in the reference file.
+     */
+    inline int getContig(int ref) const {
+        if (ref >= (int)contigs.size()) {
+            cerr << "The alignment file has a broken BAM record." << endl;
+            throw 1;
+        }
+        if (contigs[ref] < 0) {
+            cerr << "Cannot find the chromosome: " << names[ref]
+                 << " in reference file." << endl;
+            throw 1;
+        }
+        return contigs[ref];
+    }
+
+    /**
+     * read the BAM header from the beginning of the file.
+     */
+    template <typename Reader> void load(Reader &reader) {
+        char buff[4];
+        if (!reader.read(buff, 4) || memcmp(buff, "BAM\1", 4) != 0) {
+            cerr << "The alignment file is not a BAM file." << endl;
+            throw 1;
+        }
+        string text;
+        readString(reader, readLength(reader), text);
+        int nRef = readLength(reader);
+        names.clear();
+        lengths.clear();
+        for (int i = 0; i < nRef; i++) {
+            string name;
+            readString(reader, readLength(reader), name);
+            names.push_back(name.substr(0, name.find('\0')));
+            readBytes(reader, buff, 4);
+            lengths.push_back(readInt32(buff));
+        }
+    }
+
+  private:
+    /**
+     * read n bytes of the header, throw if the file ends before them.
+     */
+    template <typename Reader>
+    static void readBytes(Reader &reader, char *output, int n) {
+        if (!reader.read(output, n)) {
+            cerr << "The alignment file is truncated." << endl;
+            throw 1;
+        }
+    }
+
+    /**
+     * read a length or count field of the header, throw if it is negative.
+     */
+    template <typename Reader> static int readLength(Reader &reader) {
+        char buff[4];
+        readBytes(reader, buff, 4);
+        int n = readInt32(buff);
+        if (n < 0) {
+            cerr << "The alignment file has a broken BAM header." << endl;
+            throw 1;
+        }
+        return n;
+    }
+
+    /**
+     * read n bytes of the header to s. s grows with the bytes read, so a
+     * broken length cannot allocate more than the file holds.
+     */
+    template <typename Reader>
+    static void readString(Reader &reader, int n, string &s) {
+        char buff[4096];
+        s.clear();
+        while (n > 0) {
+            int len = min(n, (int)sizeof(buff));
+            readBytes(reader, buff, len);
+            s.append(buff, len);
+            n -= len;
+        }
+    }
+};
+
+/**
+ * one binary alignment record from BAM file, without the block_size field.
+ */
+class BAMRecord {
+  public:
+    vector<char> data;
+    int length = 0;
+
+    /**
+     * read the next record. return false at the end of file.
+     */
+    template <typename Reader> bool read(Reader &reader) {
+        char buff[4];
+        if (!reader.read(buff, 4)) {
+            return false;
+        }
+        length = readInt32(buff);
+        if (length < 32) {
+            cerr << "The alignment file has a broken BAM record." << endl;
+            throw 1;
+        }
+        if (length > (int)data.size()) {
+            data.resize(length);
+        }
+        if (!reader.read(data.data(), length)) {
+            cerr << "The alignment file is truncated." << endl;
+            throw 1;
+        }
+        checkLayout(data.data(), length);
+        return true;
+    }
+
+    /**
+     * throw if the read name, CIGAR and sequence of the record p do not fit
+     * in its length bytes.
+     */
+    static void checkLayout(const char *p, int length) {
+        int nameLength = (unsigned char)p[8];
+        int nCigar = readUInt16(p + 12);
+        long long int seqLength = readInt32(p + 16);
+        if (seqLength < 0 || 32 + nameLength + 4LL * nCigar +
+                                     (seqLength + 1) / 2 + seqLength >
+                                 length) {
+            cerr << "The alignment file has a broken BAM record." << endl;
+            throw 1;
+        }
+    }
+
+    int refID() const { return readInt32(data.data()); }
+
+    long long int location() const { // 1-based position
+        return readInt32(data.data() + 4) + 1;
+    }
+
+    /**
+     * the bp of reference covered by the CIGAR operations, with the introns.
+     */
+    long long int coveredLength() const {
+        const char *p = data.data();
+        int nCigar = readUInt16(p + 12);
+        const char *cigar = p + 32 + (unsigned char)p[8];
+        long long int length = 0;
+        for (int i = 0; i < nCigar; i++) {
+            uint32_t op = readUInt32(cigar + 4 * i);
+            // M, D, N, = and X consume the reference.
+            if ((0x18d >> (op & 0xf)) & 1) {
+                length += op >> 4;
+            }
+        }
+        return length;
+    }
+
+    /**
+     * decode this record to alignment.
+     */
+    void toAlignment(Alignment &alignment, const BAMHeader &header) {
+        decode(data.data(), length, alignment, header);
+    }
+
+    /**
+     * decode the record p of length bytes to alignment, same as
+     * Alignment::parseInfo on the SAM line. the qualities are not used, so
+     * they are not decoded.
+     */
+    static void decode(const char *p, int length, Alignment &alignment,
+                       const BAMHeader &header) {
+        static const char *seqSymbols = "=ACMGRSVTWYHKDBN";
+        checkLayout(p, length);
+        alignment.initialize();
+
+        int ref = readInt32(p);
+        alignment.contig = ref >= 0 ? header.getContig(ref) : -1;
+        alignment.location = readInt32(p + 4) + 1;
+        int nameLength = (unsigned char)p[8];
+        int mapQ = (unsigned char)p[9];
+        int nCigar = readUInt16(p + 12);
+        alignment.flag = readUInt16(p + 14);
+        int seqLength = readInt32(p + 16);
+        alignment.mateLocation = readInt32(p + 24) + 1;
+        alignment.mapped = (alignment.flag & 4) == 0;
+        alignment.paired = (alignment.flag & 1) != 0;
+        alignment.unique = mapQ != 1;
+
+        const char *cigar = p + 32 + nameLength;
+        alignment.cigarString.loadOps(cigar, nCigar);
+
+        const char *seq = cigar + nCigar * 4;
+        alignment.sequence.resize(seqLength);
+        for (int i = 0; i < seqLength; i++) {
+            unsigned char c = seq[i / 2];
+            alignment.sequence[i] = seqSymbols[i % 2 ? c & 0xf : c >> 4];
+        }
+        const char *qual = seq + (seqLength + 1) / 2;
+
+        const char *aux = qual + seqLength;
+        const char *end = p + length;
+        while (aux + 3 <= end) {
+            const char *tag = aux;
+            char type = aux[2];
+            const char *value = aux + 3;
+            aux = skipAuxValue(type, value, end);
+            if (aux > end) {
+                cerr << "The alignment file has a broken BAM record." << endl;
+                throw 1;
+            }
+            if (tag[0] == 'M' && tag[1] == 'D' && type == 'Z') {
+                alignment.MD.loadString(value, strlen(value));
+            } else if (tag[0] == 'N' && tag[1] == 'M') {
+                alignment.NH = (int)auxInteger(type, value);
+            } else if (tag[0] == 'Y' && tag[1] == 'Z' && type == 'A') {
+                alignment.strand = value[0];
+            }
+        }
+    }
+
+  private:
+    static long long int auxInteger(char type, const char *value) {
+        switch (type) {
+        case 'c': return (int8_t)value[0];
+        case 'C': return (uint8_t)value[0];
+        case 's': return (int16_t)readUInt16(value);
+        case 'S': return readUInt16(value);
+        case 'i': return readInt32(value);
+        case 'I': return readUInt32(value);
+        default: return 0;
+        }
+    }
+
+    /**
+     * return the start of next aux field, after end if the value does not
+     * fit before end.
+     */
+    static const char *skipAuxValue(char type, const char *value,
+                                    const char *end) {
+        switch (type) {
+        case 'A': case 'c': case 'C': return value + 1;
+        case 's': case 'S': return value + 2;
+        case 'i': case 'I': case 'f': return value + 4;
+        case 'Z': case 'H':
+            while (value < end && *value != '\0') value++;
+            return value + 1;
+        case 'B': {
+            if (value + 5 > end) {
+                return end + 1;
+            }
+            char subtype = value[0];
+            int n = readInt32(value + 1);
+            int size = (subtype == 'c' || subtype == 'C') ? 1
+                       : (subtype == 's' || subtype == 'S') ? 2 : 4;
+            return value + 5 + (long long int)n * size;
+        }
+        default:
+            cerr << "The alignment file has an unknown BAM tag type: " << type
+                 << endl;
+            throw 1;
+        }
+    }
+};
+
+/**
+ * the BAM index (.bai). only keep what is needed to find where the
+ * alignments of one reference start.
+ */
+class BAMIndex {
+  public:
+    vector<uint64_t> firstOffset; // smallest virtual offset of each reference.
+    vector<uint64_t> lastOffset;  // largest virtual offset of each reference.
+    vector<vector<uint64_t> > linearIndex; // 16 kbp windows.
+
+    /**
+     * find the index next to the BAM file. return false if there is none.
+     */
+    static bool findIndexFile(const string &bamFileName, string &indexFileName) {
+        string candidates[2] = {bamFileName + ".bai", ""};
+        if (bamFileName.size() > 4 &&
+            bamFileName.compare(bamFileName.size() - 4, 4, ".bam") == 0) {
+            candidates[1] = bamFileName.substr(0, bamFileName.size() - 4) + ".bai";
+        }
+        for (int i = 0; i < 2; i++) {
+            if (candidates[i].empty()) continue;
+            FILE *f = fopen(candidates[i].c_str(), "rb");
+            if (f != NULL) {
+                fclose(f);
+                indexFileName = candidates[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void load(const string &indexFileName) {
+        FILE *f = fopen(indexFileName.c_str(), "rb");
+        if (f == NULL) {
+            cerr << "Cannot open the BAM index: " << indexFileName << endl;
+            throw 1;
+        }
+        char buff[16];
+        if (fread(buff, 1, 8, f) != 8 || memcmp(buff, "BAI\1", 4) != 0) {
+            cerr << "The BAM index is not valid: " << indexFileName << endl;
+            fclose(f);
+            throw 1;
+        }
+        int nRef = readInt32(buff + 4);
+        firstOffset.assign(nRef, UINT64_MAX);
+        lastOffset.assign(nRef, 0);
+        linearIndex.resize(nRef);
+        bool good = true;
+        for (int r = 0; r < nRef && good; r++) {
+            int32_t nBin;
+            good = fread(&nBin, 4, 1, f) == 1;
+            for (int b = 0; b < nBin && good; b++) {
+                uint32_t bin;
+                int32_t nChunk;
+                good = fread(&bin, 4, 1, f) == 1 && fread(&nChunk, 4, 1, f) == 1;
+                for (int c = 0; c < nChunk && good; c++) {
+                    uint64_t chunk[2];
+                    good = fread(chunk, 8, 2, f) == 2;
+                    if (bin == 37450) { // pseudo-bin with the statistics.
+                        continue;
+                    }
+                    firstOffset[r] = min(firstOffset[r], chunk[0]);
+                    lastOffset[r] = max(lastOffset[r], chunk[1]);
+                }
+            }
+            int32_t nIntv;
+            good = good && fread(&nIntv, 4, 1, f) == 1;
+            if (good) {
+                linearIndex[r].resize(nIntv);
+                good = fread(linearIndex[r].data(), 8, nIntv, f) == (size_t)nIntv;
+            }
+        }
+        fclose(f);
+        if (!good) {
+            cerr << "The BAM index is truncated: " << indexFileName << endl;
+            throw 1;
+        }
+    }
+
+    bool hasAlignments(int ref) { return firstOffset[ref] != UINT64_MAX; }
+
+    /**
+     * the virtual offset to start reading alignments of ref at 0-based
+     * location. alignments before location may still be read.
+     */
+    uint64_t getOffset(int ref, long long int location) {
+        vector<uint64_t> &linear = linearIndex[ref];
+        long long int window = location >> 14;
+        if (window >= (long long int)linear.size()) {
+            window = (long long int)linear.size() - 1;
+        }
+        for (; window >= 0; window--) {
+            if (linear[window] != 0) {
+                return max(linear[window], firstOffset[ref]);
+            }
+        }
+        return firstOffset[ref];
+    }
+
+    /**
+     * the size of compressed data for ref, used to schedule larger work first.
+     */
+    uint64_t getCompressedSize(int ref) {
+        if (!hasAlignments(ref)) {
+            return 0;
+        }
+        return (lastOffset[ref] >> 16) - (firstOffset[ref] >> 16) + 1;
+    }
+};
+
+#endif // BAM_3N_TABLE_H
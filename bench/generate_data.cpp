@@ -0,0 +1,58 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * write the synthetic reference (<prefix>.fa) and sorted alignments
+ * (<prefix>.sam) for benchmarking. the same options make the same files.
+ */
+
+#include "synthetic_data.h"
+#include <cstdio>
+#include <string>
+
+using namespace std;
+
+void printHelp(const char *s) {
+    printf("Usage: %s [options] <output prefix>\n", s);
+    printSyntheticOptions();
+    exit(-1);
+}
+
+static void writeFile(const string &fileName, const string &text) {
+    FILE *file = fopen(fileName.c_str(), "wb");
+    if (file == NULL || fwrite(text.data(), 1, text.size(), file) != text.size() ||
+        fclose(file) != 0) {
+        fprintf(stderr, "Cannot write %s\n", fileName.c_str());
+        exit(1);
+    }
+}
+
+int main(int argc, const char **argv) {
+    SyntheticOptions options;
+    int first = parseSyntheticOptions(argc, argv, options, printHelp);
+    if (argc - first != 1) {
+        printHelp(argv[0]);
+    }
+    string prefix = argv[first];
+    SyntheticData data;
+    data.makeReference(options);
+    writeFile(prefix + ".fa", data.getFASTA());
+    writeFile(prefix + ".sam", data.getSAM(options));
+    return 0;
+}
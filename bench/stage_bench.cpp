@@ -0,0 +1,240 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * microbenchmarks of the counting stages on synthetic data: CIGAR and MD
+ * walking, Alignment::parse, Positions::appendRefPosition, appendPositions,
+ * startOutput (outputTable), and the whole sorted SAM path. each stage
+ * reports reads/s and bases/s.
+ * usage: stage_bench [synthetic data options]
+ */
+
+#include "../position_3n_table.h"
+#include "synthetic_data.h"
+#include <chrono>
+#include <fcntl.h>
+
+using namespace std;
+
+char baseChangeFrom = 'C';
+char baseChangeTo = 'T';
+RunStats *runStats = NULL;
+
+typedef CountingPolicy<Conversion<'C', 'T'>, Selection<true, true>> BenchPolicy;
+
+void printHelp(const char *s) {
+    printf("Usage: %s [options]\n", s);
+    printSyntheticOptions();
+    exit(-1);
+}
+
+/**
+ * call run until it takes at least minSeconds, then print the rate of the
+ * reads and bases one call handles.
+ */
+template <typename F>
+static void report(const char *name, double reads, double bases, F run) {
+    const double minSeconds = 0.5;
+    int rounds = 0;
+    double seconds = 0;
+    auto start = chrono::steady_clock::now();
+    while (seconds < minSeconds) {
+        run();
+        rounds++;
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start)
+                      .count();
+    }
+    if (reads > 0) {
+        printf("%-30s %12.0f reads/s %14.0f bases/s\n", name,
+               reads * rounds / seconds, bases * rounds / seconds);
+    } else {
+        printf("%-30s %12s reads/s %14.0f bases/s\n", name, "-",
+               bases * rounds / seconds);
+    }
+}
+
+int main(int argc, const char **argv) {
+    SyntheticOptions options;
+    if (parseSyntheticOptions(argc, argv, options, printHelp) != argc) {
+        printHelp(argv[0]);
+    }
+    SyntheticData data;
+    data.makeReference(options);
+    string sam = data.getSAM(options);
+
+    // the reference is read from a file, like the real run.
+    string refFileName;
+    int fd = makeTempFile(refFileName);
+    string fasta = data.getFASTA();
+    if (write(fd, fasta.data(), fasta.size()) != (ssize_t)fasta.size() ||
+        close(fd) != 0) {
+        cerr << "Cannot write temporary file: " << refFileName << endl;
+        return 1;
+    }
+    vector<char> modes = {'u', 'm'};
+    // the contig ids of the parsed alignments, same in every Positions.
+    Positions<BenchPolicy> reference(refFileName, modes);
+
+    SAMTokenizer tokenizer;
+    tokenizer.tokenize(sam.data(), sam.size());
+    vector<const SAMRecordView *> records;
+    for (size_t i = 0; i < tokenizer.records.size(); i++) {
+        if (sam[tokenizer.records[i].begin] != '@') {
+            records.push_back(&tokenizer.records[i]);
+        }
+    }
+    vector<Alignment> alignments(records.size());
+    double nBases = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        alignments[i].contigCache.dictionary = &reference.contigs;
+        alignments[i].parse<BenchPolicy>(
+            sam.data() + records[i]->begin,
+            tokenizer.fieldEnds.data() + records[i]->firstField,
+            records[i]->nFields);
+        nBases += alignments[i].sequence.size();
+    }
+    double nReads = records.size();
+    printf("%zu chromosomes of %lld bp, %.0f reads of %d bp\n",
+           data.chromosomes.size(), options.chromosomeLength, nReads,
+           options.readLength);
+
+    report("CIGAR::getNextSegment", nReads, nBases, [&]() {
+        CIGAR cigar;
+        long long int length = 0;
+        for (size_t i = 0; i < alignments.size(); i++) {
+            const string &s = alignments[i].cigarString.s;
+            cigar.loadString(s.data(), s.size());
+            int len;
+            char symbol;
+            while (cigar.getNextSegment(len, symbol)) {
+                length += len;
+            }
+        }
+        if (length == 0) {
+            printf("no CIGAR\n");
+        }
+    });
+
+    report("MD_tag::getNextBase", nReads, nBases, [&]() {
+        MD_tag md;
+        long long int matches = 0;
+        for (size_t i = 0; i < alignments.size(); i++) {
+            const string &s = alignments[i].MD.s;
+            md.loadString(s.data(), s.size());
+            char refBase;
+            int match;
+            while ((match = md.getNextBase(refBase)) >= 0) {
+                matches += match;
+            }
+        }
+        if (matches == 0) {
+            printf("no MD\n");
+        }
+    });
+
+    report("Alignment::parse", nReads, nBases, [&]() {
+        Alignment alignment;
+        alignment.contigCache.dictionary = &reference.contigs;
+        for (size_t i = 0; i < records.size(); i++) {
+            alignment.parse<BenchPolicy>(
+                sam.data() + records[i]->begin,
+                tokenizer.fieldEnds.data() + records[i]->firstField,
+                records[i]->nFields);
+        }
+    });
+
+    {
+        Positions<BenchPolicy> positions(refFileName, modes);
+        const string &bases = data.chromosomes[0];
+        report("Positions::appendRefPosition", 0, bases.size(), [&]() {
+            for (size_t i = 0; i < bases.size(); i += loadingBlockSize) {
+                int n = min((size_t)loadingBlockSize, bases.size() - i);
+                positions.appendRefPosition(bases.data() + i, n,
+                                            positions.refPosEndPtr);
+                // drop the block, as startOutput does after the output.
+                positions.refPosStartPtr = positions.refPosEndPtr;
+                positions.refPositions.nSites = 0;
+            }
+        });
+    }
+
+    {
+        // the whole first chromosome is in the window, so only the bases of
+        // the reads are counted.
+        Positions<BenchPolicy> positions(refFileName, modes);
+        int devNull = open("/dev/null", O_WRONLY);
+        vector<OutputWriter> outputs(modes.size());
+        for (size_t t = 0; t < modes.size(); t++) {
+            outputs[t].open(devNull, false);
+            positions.outs[t] = &outputs[t];
+        }
+        int contig = positions.contigs.get(data.names[0]);
+        positions.startChromosome(contig, 0);
+        positions.extendWindow(options.chromosomeLength);
+        size_t n = 0;
+        double bases = 0;
+        while (n < alignments.size() && alignments[n].contig == contig) {
+            bases += alignments[n].sequence.size();
+            n++;
+        }
+        report("Positions::appendPositions", n, bases, [&]() {
+            for (size_t i = 0; i < n; i++) {
+                Alignment &alignment = alignments[i];
+                alignment.MD.start = 0;
+                alignment.MD.matchLeft = 0;
+                positions.appendPositions(alignment);
+            }
+        });
+
+        int length = positions.windowLength();
+        report("Positions::startOutput", 0, length * modes.size(), [&]() {
+            for (size_t t = 0; t < modes.size(); t++) {
+                positions.outputTable(t, length);
+            }
+        });
+        for (size_t t = 0; t < modes.size(); t++) {
+            outputs[t].close();
+        }
+        close(devNull);
+    }
+
+    report("sorted SAM (whole path)", nReads, nBases, [&]() {
+        Positions<BenchPolicy> positions(refFileName, modes);
+        int devNull = open("/dev/null", O_WRONLY);
+        vector<OutputWriter> outputs(modes.size());
+        for (size_t t = 0; t < modes.size(); t++) {
+            outputs[t].open(devNull, true);
+            positions.outs[t] = &outputs[t];
+        }
+        for (size_t i = 0; i < records.size(); i++) {
+            positions.appendSync(sam.data() + records[i]->begin,
+                                 tokenizer.fieldEnds.data() + records[i]->firstField,
+                                 records[i]->nFields);
+        }
+        positions.startOutput(true);
+        for (size_t t = 0; t < modes.size(); t++) {
+            outputs[t].close();
+        }
+        close(devNull);
+    });
+
+    remove(refFileName.c_str());
+    remove((refFileName + ".fai").c_str());
+    return 0;
+}
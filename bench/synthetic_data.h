@@ -0,0 +1,287 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYNTHETIC_DATA_H
+#define SYNTHETIC_DATA_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * the shape of the synthetic data.
+ */
+class SyntheticOptions {
+  public:
+    int nChromosomes = 2;
+    long long int chromosomeLength = 2000000;
+    int readLength = 100;
+    double depth = 5;              // mean coverage of the reads.
+    double spliceRate = 0.1;       // the reads with one intron (N).
+    int intronLength = 2000;       // mean intron length.
+    double mismatchRate = 0.005;   // random mismatches per base.
+    double conversionRate = 0.3;   // converted C (G on - strand) per base.
+    double multipleRate = 0.2;     // the reads which are multiple mapped.
+    uint64_t seed = 1;
+};
+
+/**
+ * parse the options of SyntheticOptions. return optind, the first other
+ * argument.
+ */
+inline int parseSyntheticOptions(int argc, const char **argv,
+                                 SyntheticOptions &options,
+                                 void (*printHelp)(const char *)) {
+    static struct option longOptions[] = {
+        {"chromosomes", required_argument, 0, 'c'},
+        {"length", required_argument, 0, 'l'},
+        {"read-length", required_argument, 0, 'r'},
+        {"depth", required_argument, 0, 'd'},
+        {"splice-rate", required_argument, 0, 's'},
+        {"intron-length", required_argument, 0, 'n'},
+        {"mismatch-rate", required_argument, 0, 'm'},
+        {"conversion-rate", required_argument, 0, 'v'},
+        {"multiple-rate", required_argument, 0, 'u'},
+        {"seed", required_argument, 0, 'S'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}};
+    int option;
+    while ((option = getopt_long(argc, (char *const *)argv, "h", longOptions,
+                                 NULL)) != -1) {
+        switch (option) {
+        case 'c':
+            options.nChromosomes = atoi(optarg);
+            break;
+        case 'l':
+            options.chromosomeLength = atoll(optarg);
+            break;
+        case 'r':
+            options.readLength = atoi(optarg);
+            break;
+        case 'd':
+            options.depth = atof(optarg);
+            break;
+        case 's':
+            options.spliceRate = atof(optarg);
+            break;
+        case 'n':
+            options.intronLength = atoi(optarg);
+            break;
+        case 'm':
+            options.mismatchRate = atof(optarg);
+            break;
+        case 'v':
+            options.conversionRate = atof(optarg);
+            break;
+        case 'u':
+            options.multipleRate = atof(optarg);
+            break;
+        case 'S':
+            options.seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            printHelp(argv[0]);
+        }
+    }
+    if (options.nChromosomes < 1 || options.readLength < 20 ||
+        options.chromosomeLength < 10LL * options.readLength ||
+        options.depth <= 0 || options.intronLength < 1) {
+        printHelp(argv[0]);
+    }
+    return optind;
+}
+
+inline void printSyntheticOptions() {
+    printf("  --chromosomes <int>       number of chromosomes (default: 2)\n");
+    printf("  --length <int>            length of each chromosome (default: 2000000)\n");
+    printf("  --read-length <int>       read length (default: 100)\n");
+    printf("  --depth <float>           mean coverage (default: 5)\n");
+    printf("  --splice-rate <float>     fraction of reads with an intron (default: 0.1)\n");
+    printf("  --intron-length <int>     mean intron length (default: 2000)\n");
+    printf("  --mismatch-rate <float>   random mismatches per base (default: 0.005)\n");
+    printf("  --conversion-rate <float> converted bases per convertible base (default: 0.3)\n");
+    printf("  --multiple-rate <float>   fraction of multiple mapped reads (default: 0.2)\n");
+    printf("  --seed <int>              random seed (default: 1)\n");
+}
+
+/**
+ * a small random generator (splitmix64), so the data is the same on every
+ * platform for one seed.
+ */
+class SyntheticRandom {
+  public:
+    uint64_t state;
+
+    explicit SyntheticRandom(uint64_t seed) : state(seed) {}
+
+    inline uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    /**
+     * uniform in [0, n).
+     */
+    inline uint64_t below(uint64_t n) { return next() % n; }
+
+    /**
+     * uniform in [0, 1).
+     */
+    inline double uniform() { return (next() >> 11) * (1.0 / (1ULL << 53)); }
+};
+
+/**
+ * make the reference and the sorted SAM lines of SyntheticOptions. the
+ * reads are from the 3N + strand (C->T) or - strand (G->A).
+ */
+class SyntheticData {
+  public:
+    vector<string> names;
+    vector<string> chromosomes;
+
+    void makeReference(const SyntheticOptions &options) {
+        SyntheticRandom random(options.seed);
+        names.clear();
+        chromosomes.clear();
+        for (int c = 0; c < options.nChromosomes; c++) {
+            names.push_back("chr" + to_string(c + 1));
+            string bases(options.chromosomeLength, 'A');
+            for (long long int i = 0; i < options.chromosomeLength; i++) {
+                bases[i] = "ACGT"[random.below(4)];
+            }
+            chromosomes.push_back(bases);
+        }
+    }
+
+    /**
+     * the reference as FASTA, 60 bases a line.
+     */
+    string getFASTA() const {
+        string text;
+        for (size_t c = 0; c < chromosomes.size(); c++) {
+            text += ">" + names[c] + "\n";
+            for (size_t i = 0; i < chromosomes[c].size(); i += 60) {
+                text.append(chromosomes[c], i, 60);
+                text += '\n';
+            }
+        }
+        return text;
+    }
+
+    /**
+     * the SAM text with the header, sorted by chromosome and location.
+     */
+    string getSAM(const SyntheticOptions &options) const {
+        SyntheticRandom random(options.seed * 31 + 7);
+        string text = "@HD\tVN:1.0\tSO:coordinate\n";
+        for (size_t c = 0; c < chromosomes.size(); c++) {
+            text += "@SQ\tSN:" + names[c] +
+                    "\tLN:" + to_string(chromosomes[c].size()) + "\n";
+        }
+        long long int readId = 0;
+        for (size_t c = 0; c < chromosomes.size(); c++) {
+            long long int length = chromosomes[c].size();
+            long long int nReads =
+                (long long int)(options.depth * length / options.readLength);
+            vector<long long int> starts(nReads);
+            for (long long int i = 0; i < nReads; i++) {
+                starts[i] = random.below(length - options.readLength);
+            }
+            sort(starts.begin(), starts.end());
+            for (long long int i = 0; i < nReads; i++) {
+                appendRead(options, random, c, starts[i], readId++, text);
+            }
+        }
+        return text;
+    }
+
+  private:
+    /**
+     * append one read at start (0-based) of chromosome c.
+     */
+    void appendRead(const SyntheticOptions &options, SyntheticRandom &random,
+                    size_t c, long long int start, long long int readId,
+                    string &text) const {
+        const string &ref = chromosomes[c];
+        int readLength = options.readLength;
+        // the aligned blocks: [0, split) and [split, readLength), with the
+        // intron between them.
+        int split = readLength;
+        long long int intron = 0;
+        if (random.uniform() < options.spliceRate) {
+            split = 10 + random.below(readLength - 20);
+            intron = options.intronLength / 2 + random.below(options.intronLength + 1);
+            if (start + readLength + intron > (long long int)ref.size()) {
+                split = readLength;
+                intron = 0;
+            }
+        }
+        char strand = random.below(2) ? '+' : '-';
+        char from = strand == '+' ? 'C' : 'G';
+        char to = strand == '+' ? 'T' : 'A';
+
+        string sequence(readLength, 'N');
+        string md;
+        int matches = 0;
+        int nMismatches = 0;
+        for (int k = 0; k < readLength; k++) {
+            long long int pos = start + k + (k >= split ? intron : 0);
+            char refBase = ref[pos];
+            char base = refBase;
+            if (refBase == from && random.uniform() < options.conversionRate) {
+                base = to;
+            } else if (random.uniform() < options.mismatchRate) {
+                base = "ACGT"[(string("ACGT").find(refBase) + 1 +
+                               random.below(3)) % 4];
+            }
+            sequence[k] = base;
+            if (base == refBase) {
+                matches++;
+            } else {
+                md += to_string(matches);
+                md += refBase;
+                matches = 0;
+                nMismatches++;
+            }
+        }
+        md += to_string(matches);
+
+        string cigar = split == readLength
+                           ? to_string(readLength) + "M"
+                           : to_string(split) + "M" + to_string(intron) + "N" +
+                                 to_string(readLength - split) + "M";
+        bool multiple = random.uniform() < options.multipleRate;
+        text += "r" + to_string(readId) + "\t" + (strand == '+' ? "0" : "16") +
+                "\t" + names[c] + "\t" + to_string(start + 1) + "\t" +
+                (multiple ? "1" : "60") + "\t" + cigar + "\t*\t0\t0\t" +
+                sequence + "\t" + string(readLength, 'I') +
+                "\tNM:i:" + to_string(nMismatches) + "\tMD:Z:" + md +
+                "\tYZ:A:" + strand + "\tNH:i:" + (multiple ? "2" : "1") + "\n";
+    }
+};
+
+#endif // SYNTHETIC_DATA_H
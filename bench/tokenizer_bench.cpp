@@ -0,0 +1,160 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * compare SAMTokenizer (with each delimiter kernel) to the scalar line and
+ * field search it replaces: fgets-like line splitting and memchr for each
+ * tab.
+ * usage: tokenizer_bench [SAM file]. without the file, synthetic SAM lines
+ * are used.
+ */
+
+#include "../tokenizer_3n_table.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * make nLines SAM lines of 100 bp reads, the same every run.
+ */
+static string makeSAM(int nLines) {
+    string text;
+    unsigned int seed = 12345;
+    const char *bases = "ACGT";
+    char buff[256];
+    for (int i = 0; i < nLines; i++) {
+        seed = seed * 1103515245 + 12345;
+        snprintf(buff, sizeof(buff), "r%d\t%d\tchr%d\t%u\t1\t100M\t=\t%u\t0\t",
+                 i, (seed >> 8) & 16, 1 + (seed >> 20) % 3, i * 7 + 1,
+                 i * 7 + 200);
+        text += buff;
+        for (int k = 0; k < 100; k++) {
+            seed = seed * 1103515245 + 12345;
+            text += bases[(seed >> 16) & 3];
+        }
+        text += '\t';
+        text.append(100, 'I');
+        text += "\tNM:i:1\tMD:Z:42T57\tYZ:A:+\tNH:i:1\n";
+    }
+    return text;
+}
+
+static string readFile(const char *fileName) {
+    FILE *file = fopen(fileName, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot open %s\n", fileName);
+        exit(1);
+    }
+    string text;
+    char buff[1 << 16];
+    size_t n;
+    while ((n = fread(buff, 1, sizeof(buff), file)) > 0) {
+        text.append(buff, n);
+    }
+    fclose(file);
+    return text;
+}
+
+/**
+ * the scalar search: find each line end, then each tab in the line.
+ */
+static size_t scalarSplit(const char *text, size_t length,
+                          vector<uint32_t> &fieldEnds) {
+    size_t nLines = 0;
+    const char *p = text;
+    const char *end = text + length;
+    fieldEnds.clear();
+    while (p < end) {
+        const char *lineEnd = (const char *)memchr(p, '\n', end - p);
+        if (lineEnd == NULL) {
+            lineEnd = end;
+        }
+        const char *field = p;
+        while (true) {
+            const char *fieldEnd =
+                (const char *)memchr(field, '\t', lineEnd - field);
+            if (fieldEnd == NULL) {
+                fieldEnds.push_back(lineEnd - p);
+                break;
+            }
+            fieldEnds.push_back(fieldEnd - p);
+            field = fieldEnd + 1;
+        }
+        nLines++;
+        p = lineEnd + 1;
+    }
+    return nLines;
+}
+
+template <typename F>
+static void report(const char *name, const string &text, int rounds, F run) {
+    size_t nLines = 0;
+    size_t nFields = 0;
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        run(nLines, nFields);
+    }
+    double seconds =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("%-16s %10.1f MB/s %12.0f lines/s  (%zu lines, %zu fields)\n", name,
+           text.size() * (double)rounds / seconds / 1e6,
+           nLines / seconds, nLines / rounds, nFields / rounds);
+}
+
+static void benchTokenizer(const char *name, const string &text, int rounds,
+                           DelimiterFunction function) {
+    SAMTokenizer tokenizer;
+    tokenizer.findDelimiters = function;
+    report(name, text, rounds, [&](size_t &nLines, size_t &nFields) {
+        for (size_t begin = 0; begin < text.size(); begin += samBlockSize) {
+            size_t length = min(samBlockSize, text.size() - begin);
+            // the blocks are not cut at line ends here, the rest is counted
+            // as one more line.
+            tokenizer.tokenize(text.data() + begin, length);
+            nLines += tokenizer.records.size();
+            nFields += tokenizer.fieldEnds.size();
+        }
+    });
+}
+
+int main(int argc, const char **argv) {
+    string text = argc > 1 ? readFile(argv[1]) : makeSAM(500000);
+    int rounds = max(1, (int)(2000000000 / max(text.size(), (size_t)1)));
+    printf("%zu bytes, %d rounds\n", text.size(), rounds);
+
+    vector<uint32_t> fieldEnds;
+    report("scalar memchr", text, rounds, [&](size_t &nLines, size_t &nFields) {
+        for (size_t begin = 0; begin < text.size(); begin += samBlockSize) {
+            size_t length = min(samBlockSize, text.size() - begin);
+            nLines += scalarSplit(text.data() + begin, length, fieldEnds);
+            nFields += fieldEnds.size();
+        }
+    });
+    benchTokenizer("tokenizer scalar", text, rounds, findDelimitersScalar);
+#if defined(__x86_64__) || defined(__i386__)
+    benchTokenizer("tokenizer sse2", text, rounds, findDelimitersSSE2);
+    if (__builtin_cpu_supports("avx2")) {
+        benchTokenizer("tokenizer avx2", text, rounds, findDelimitersAVX2);
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,371 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECKPOINT_3N_TABLE_H
+#define CHECKPOINT_3N_TABLE_H
+
+#include "output_3n_table.h"
+#include "stats_3n_table.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+const char checkpointMagic[] = "hisat-3n-table checkpoint 1";
+
+/**
+ * one finished piece of the output in the checkpoint directory: the rows of
+ * one contig (or a contig range) in a file of each table, named by key.
+ * offset is where the input is read again to count the pieces after it.
+ */
+class CheckpointPart {
+  public:
+    string key;
+    string chromosome;
+    long long int offset = -1;
+    vector<long long int> rows;               // of each table.
+    vector<vector<ColumnarChunkInfo>> chunks; // of each table, in binary mode.
+};
+
+/**
+ * write the output of each contig to a work directory and record the
+ * finished contigs in its manifest, so a killed run is resumed from the
+ * first unfinished contig. the manifest has the options of the run, then a
+ * line of each part after its files are synced, then "end" when the input
+ * is finished. the final tables are the parts concatenated in order.
+ */
+class Checkpoint {
+  private:
+    string directory;
+    int nTables = 0;
+    bool binary = false;
+    int manifestFd = -1;
+    mutex manifestMutex; // the parts of contig parallel mode are committed
+                         // by the worker threads.
+
+    // the part being written by sequential counting.
+    CheckpointPart current;
+    vector<int> fds;
+    vector<unique_ptr<OutputWriter>> writers;
+
+    string manifestFileName() { return directory + "/manifest"; }
+
+    /**
+     * append text to the manifest and sync it.
+     */
+    void appendManifest(const string &text) {
+        lock_guard<mutex> lock(manifestMutex);
+        size_t done = 0;
+        while (done < text.size()) {
+            ssize_t n = write(manifestFd, text.data() + done, text.size() - done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                cerr << "Cannot write the checkpoint manifest: "
+                     << manifestFileName() << endl;
+                throw 1;
+            }
+            done += n;
+        }
+        if (fsync(manifestFd) != 0) {
+            cerr << "Cannot write the checkpoint manifest: "
+                 << manifestFileName() << endl;
+            throw 1;
+        }
+    }
+
+    static string formatPart(const CheckpointPart &part) {
+        ostringstream line;
+        line << "part\t" << part.key << '\t' << part.chromosome << '\t'
+             << part.offset;
+        for (size_t t = 0; t < part.rows.size(); t++) {
+            line << '\t' << part.rows[t] << '\t' << part.chunks[t].size();
+            for (size_t i = 0; i < part.chunks[t].size(); i++) {
+                const ColumnarChunkInfo &chunk = part.chunks[t][i];
+                line << '\t' << chunk.nRows << '\t' << chunk.firstLocation
+                     << '\t' << chunk.lastLocation << '\t' << chunk.offset;
+            }
+        }
+        line << '\n';
+        return line.str();
+    }
+
+    /**
+     * parse a part line of the manifest, after "part\t". return false if it
+     * is broken.
+     */
+    bool parsePart(istringstream &line, CheckpointPart &part) {
+        if (!(line >> part.key >> part.chromosome >> part.offset)) {
+            return false;
+        }
+        part.rows.resize(nTables);
+        part.chunks.resize(nTables);
+        for (int t = 0; t < nTables; t++) {
+            size_t nChunks;
+            if (!(line >> part.rows[t] >> nChunks)) {
+                return false;
+            }
+            part.chunks[t].resize(nChunks);
+            for (size_t i = 0; i < nChunks; i++) {
+                ColumnarChunkInfo &chunk = part.chunks[t][i];
+                chunk.chromosome = part.chromosome;
+                if (!(line >> chunk.nRows >> chunk.firstLocation >>
+                      chunk.lastLocation >> chunk.offset)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /**
+     * load the parts of the manifest. a line which is not finished (the run
+     * is killed while writing it) is cut off.
+     */
+    void load(const string &options) {
+        ifstream file(manifestFileName(), ios::binary);
+        string text((istreambuf_iterator<char>(file)),
+                    istreambuf_iterator<char>());
+        text.resize(text.rfind('\n') == string::npos ? 0 : text.rfind('\n') + 1);
+        if (text.empty()) {
+            return;
+        }
+        istringstream lines(text);
+        string line;
+        getline(lines, line);
+        string manifestOptions;
+        bool same = line == checkpointMagic && getline(lines, manifestOptions) &&
+                    manifestOptions == "options\t" + options;
+        if (!same) {
+            cerr << "The checkpoint directory " << directory
+                 << " is of another run (different input or options). Please "
+                    "use a new directory."
+                 << endl;
+            throw 1;
+        }
+        while (getline(lines, line)) {
+            istringstream fields(line);
+            string type;
+            fields >> type;
+            CheckpointPart part;
+            if (type == "end") {
+                finished = true;
+            } else if (type != "part" || !parsePart(fields, part)) {
+                cerr << "The checkpoint manifest is broken: "
+                     << manifestFileName() << endl;
+                throw 1;
+            } else {
+                parts.push_back(part);
+            }
+        }
+        if (truncate(manifestFileName().c_str(), text.size()) != 0) {
+            cerr << "Cannot write the checkpoint manifest: "
+                 << manifestFileName() << endl;
+            throw 1;
+        }
+    }
+
+    /**
+     * close the files of the current part and commit it, the input is read
+     * again from offset to count the parts after it.
+     */
+    void finishPart(long long int offset, const string &tail = "") {
+        for (int t = 0; t < nTables; t++) {
+            writers[t]->close();
+            current.rows[t] = writers[t]->rows;
+            current.chunks[t] = writers[t]->getChunks();
+            syncFile(fds[t], partFileName(current.key, t));
+        }
+        writers.clear();
+        current.offset = offset;
+        parts.push_back(current);
+        appendManifest(formatPart(current) + tail);
+    }
+
+  public:
+    vector<CheckpointPart> parts; // the finished parts, in the order they
+                                  // are committed.
+    bool finished = false;        // all parts are finished.
+    long long int inputOffset = 0; // of the record being counted, set by the
+                                   // sequential reader.
+
+    ~Checkpoint() {
+        if (manifestFd >= 0) {
+            ::close(manifestFd);
+        }
+    }
+
+    /**
+     * open (or make) the checkpoint directory of a run of nTables tables.
+     * options identify the run, the parts of a run with other options are
+     * not used.
+     */
+    void open(const string &inputDirectory, const string &options,
+              int inputNTables, bool inputBinary) {
+        directory = inputDirectory;
+        nTables = inputNTables;
+        binary = inputBinary;
+        if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+            cerr << "Cannot make the checkpoint directory: " << directory
+                 << endl;
+            throw 1;
+        }
+        load(options);
+        manifestFd = ::open(manifestFileName().c_str(),
+                            O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (manifestFd < 0) {
+            cerr << "Cannot open the checkpoint manifest: " << manifestFileName()
+                 << endl;
+            throw 1;
+        }
+        if (lseek(manifestFd, 0, SEEK_END) == 0) {
+            appendManifest(string(checkpointMagic) + "\noptions\t" + options +
+                           "\n");
+        }
+    }
+
+    string partFileName(const string &key, int table) {
+        return directory + "/" + key + "." + to_string(table);
+    }
+
+    /**
+     * make the file of key for table, truncated if it exists.
+     */
+    int createPartFile(const string &key, int table) {
+        string fileName = partFileName(key, table);
+        int fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            cerr << "Cannot open the checkpoint file: " << fileName << endl;
+            throw 1;
+        }
+        return fd;
+    }
+
+    /**
+     * sync and close the file of a part.
+     */
+    static void syncFile(int fd, const string &fileName) {
+        if (fsync(fd) != 0 || ::close(fd) != 0) {
+            cerr << "Cannot write the checkpoint file: " << fileName << endl;
+            throw 1;
+        }
+    }
+
+    /**
+     * commit a part written by another writer, its files are synced.
+     */
+    void commit(const CheckpointPart &part) {
+        {
+            lock_guard<mutex> lock(manifestMutex);
+            parts.push_back(part);
+        }
+        appendManifest(formatPart(part));
+    }
+
+    /**
+     * find the finished part of key, return NULL if it is not finished.
+     */
+    const CheckpointPart *findPart(const string &key) {
+        for (size_t i = 0; i < parts.size(); i++) {
+            if (parts[i].key == key) {
+                return &parts[i];
+            }
+        }
+        return NULL;
+    }
+
+    /**
+     * the input of sequential counting starts again at a new contig: commit
+     * the part before it (its rows are output), then write the following
+     * rows to a new part through outs.
+     */
+    void startPart(const string &chromosome, vector<OutputWriter *> &outs) {
+        if (!writers.empty()) {
+            finishPart(inputOffset);
+        }
+        current = CheckpointPart();
+        current.key = to_string(parts.size());
+        current.chromosome = chromosome;
+        current.rows.resize(nTables);
+        current.chunks.resize(nTables);
+        fds.resize(nTables);
+        for (int t = 0; t < nTables; t++) {
+            fds[t] = createPartFile(current.key, t);
+            writers.emplace_back(new OutputWriter());
+            writers.back()->open(fds[t], true, binary, false);
+            outs[t] = writers.back().get();
+        }
+    }
+
+    /**
+     * the input of sequential counting is finished and all rows are output,
+     * commit the last part and the end.
+     */
+    void finish() {
+        if (!writers.empty()) {
+            finishPart(-1, "end\n");
+        } else {
+            appendManifest("end\n");
+        }
+        finished = true;
+    }
+
+    /**
+     * write the parts to outs in order.
+     */
+    void stitch(const vector<OutputWriter *> &outs) {
+        StageTimer timer(stageOutput);
+        for (size_t i = 0; i < parts.size(); i++) {
+            for (int t = 0; t < nTables; t++) {
+                outs[t]->writeFile(partFileName(parts[i].key, t),
+                                   parts[i].chunks[t]);
+                outs[t]->rows += parts[i].rows[t];
+            }
+        }
+    }
+
+    /**
+     * delete the parts, the manifest and the directory after the final
+     * tables are written.
+     */
+    void remove() {
+        for (size_t i = 0; i < parts.size(); i++) {
+            for (int t = 0; t < nTables; t++) {
+                ::remove(partFileName(parts[i].key, t).c_str());
+            }
+        }
+        ::close(manifestFd);
+        manifestFd = -1;
+        ::remove(manifestFileName().c_str());
+        rmdir(directory.c_str());
+    }
+};
+
+#endif // CHECKPOINT_3N_TABLE_H
@@ -0,0 +1,352 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COLUMNAR_3N_TABLE_H
+#define COLUMNAR_3N_TABLE_H
+
+#include "utility_3n_table.h"
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+/**
+ * the binary columnar table. the rows are stored in chunks of at most
+ * columnarChunkRows rows of one chromosome, each column of a chunk is stored
+ * separately:
+ *   magic
+ *   chunk: ColumnarChunkHeader, location deltas (varint), strand bitmap
+ *          (1 for -), converted counts (varint), unconverted counts (varint)
+ *   ...
+ *   index: ColumnarIndexEntry of each chunk, chromosome names (uint32_t
+ *          length and name)
+ *   ColumnarFooter
+ * the integers are in the byte order of the machine, same as the reference
+ * cache.
+ */
+const char columnarMagic[8] = "H3NTAB1";
+const int columnarChunkRows = 65536;
+
+// the columns to decode.
+const int locationColumn = 1;
+const int strandColumn = 2;
+const int convertedColumn = 4;
+const int unconvertedColumn = 8;
+const int allColumns = 15;
+
+struct ColumnarChunkHeader {
+    uint32_t nRows;
+    uint32_t locationBytes;
+    int64_t firstLocation; // 1-based
+    uint32_t strandBytes;
+    uint32_t convertedBytes;
+    uint32_t unconvertedBytes;
+    uint32_t pad;
+};
+
+struct ColumnarIndexEntry {
+    uint32_t chromosome; // the index in chromosome names.
+    uint32_t nRows;
+    int64_t firstLocation;
+    int64_t lastLocation;
+    uint64_t offset; // the offset of chunk in file.
+};
+
+struct ColumnarFooter {
+    uint64_t indexOffset;
+    uint64_t nChunks;
+    uint64_t nChromosomes;
+    char magic[8];
+};
+
+inline void appendVarint(vector<char> &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+inline uint64_t readVarint(const char *&p, const char *end) {
+    uint64_t value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char c = *p++;
+        value |= (uint64_t)(c & 0x7f) << shift;
+        if (c < 0x80) {
+            return value;
+        }
+    }
+    cerr << "The table file has a broken chunk." << endl;
+    throw 1;
+}
+
+/**
+ * the chunk (before it is written) of one output file, and where it is.
+ */
+class ColumnarChunkInfo {
+  public:
+    string chromosome;
+    uint32_t nRows;
+    long long int firstLocation;
+    long long int lastLocation;
+    uint64_t offset;
+};
+
+/**
+ * the rows of one chunk, as columns.
+ */
+class ColumnarChunk {
+  public:
+    string chromosome;
+    vector<long long int> locations;
+    vector<uint64_t> strands; // bitmap, 1 for '-'.
+    vector<unsigned long long int> converted;
+    vector<unsigned long long int> unconverted;
+    size_t nRows = 0;
+
+    void clear() {
+        locations.clear();
+        strands.clear();
+        converted.clear();
+        unconverted.clear();
+        nRows = 0;
+    }
+
+    inline void append(long long int location, char strand,
+                       unsigned long long int convertedCount,
+                       unsigned long long int unconvertedCount) {
+        if (nRows % 64 == 0) {
+            strands.push_back(0);
+        }
+        if (strand == '-') {
+            strands.back() |= 1ULL << (nRows % 64);
+        }
+        locations.push_back(location);
+        converted.push_back(convertedCount);
+        unconverted.push_back(unconvertedCount);
+        nRows++;
+    }
+
+    inline char getStrand(size_t i) const {
+        return ((strands[i / 64] >> (i % 64)) & 1) ? '-' : '+';
+    }
+
+    /**
+     * append the encoded chunk to out.
+     */
+    void encode(vector<char> &out) const {
+        size_t headerPos = out.size();
+        out.resize(headerPos + sizeof(ColumnarChunkHeader));
+        ColumnarChunkHeader header;
+        memset(&header, 0, sizeof(header));
+        header.nRows = nRows;
+        header.firstLocation = nRows > 0 ? locations[0] : 0;
+
+        size_t start = out.size();
+        for (size_t i = 0; i < nRows; i++) {
+            appendVarint(out, locations[i] - (i > 0 ? locations[i - 1]
+                                                    : header.firstLocation));
+        }
+        header.locationBytes = out.size() - start;
+
+        start = out.size();
+        out.resize(start + strands.size() * sizeof(uint64_t));
+        memcpy(out.data() + start, strands.data(),
+               strands.size() * sizeof(uint64_t));
+        header.strandBytes = out.size() - start;
+
+        start = out.size();
+        for (size_t i = 0; i < nRows; i++) {
+            appendVarint(out, converted[i]);
+        }
+        header.convertedBytes = out.size() - start;
+
+        start = out.size();
+        for (size_t i = 0; i < nRows; i++) {
+            appendVarint(out, unconverted[i]);
+        }
+        header.unconvertedBytes = out.size() - start;
+        memcpy(out.data() + headerPos, &header, sizeof(header));
+    }
+
+    /**
+     * decode the selected columns of the chunk in [p, end).
+     */
+    void decode(const char *p, const char *end, int columns) {
+        clear();
+        ColumnarChunkHeader header;
+        if (end - p < (long long int)sizeof(header)) {
+            cerr << "The table file has a broken chunk." << endl;
+            throw 1;
+        }
+        memcpy(&header, p, sizeof(header));
+        p += sizeof(header);
+        if ((uint64_t)(end - p) < (uint64_t)header.locationBytes +
+                                      header.strandBytes +
+                                      header.convertedBytes +
+                                      header.unconvertedBytes ||
+            header.strandBytes != (header.nRows + 63) / 64 * sizeof(uint64_t)) {
+            cerr << "The table file has a broken chunk." << endl;
+            throw 1;
+        }
+        nRows = header.nRows;
+
+        const char *column = p;
+        if (columns & locationColumn) {
+            locations.resize(nRows);
+            long long int location = header.firstLocation;
+            const char *columnEnd = column + header.locationBytes;
+            for (size_t i = 0; i < nRows; i++) {
+                location += readVarint(column, columnEnd);
+                locations[i] = location;
+            }
+        }
+        column = p + header.locationBytes;
+        if (columns & strandColumn) {
+            strands.resize(header.strandBytes / sizeof(uint64_t));
+            memcpy(strands.data(), column, header.strandBytes);
+        }
+        column += header.strandBytes;
+        if (columns & convertedColumn) {
+            decodeCounts(column, column + header.convertedBytes, converted);
+        }
+        column += header.convertedBytes;
+        if (columns & unconvertedColumn) {
+            decodeCounts(column, column + header.unconvertedBytes, unconverted);
+        }
+    }
+
+  private:
+    void decodeCounts(const char *p, const char *end,
+                      vector<unsigned long long int> &counts) {
+        counts.resize(nRows);
+        for (size_t i = 0; i < nRows; i++) {
+            counts[i] = readVarint(p, end);
+        }
+    }
+};
+
+/**
+ * read the binary columnar table. the file is memory mapped, and only the
+ * chunks (and columns) asked are decoded.
+ */
+class ColumnarTableReader {
+  private:
+    const char *data = NULL;
+    size_t size = 0;
+    uint64_t indexOffset = 0;
+
+    void broken(const string &fileName) {
+        cerr << "The table file is broken: " << fileName << endl;
+        throw 1;
+    }
+
+  public:
+    vector<string> chromosomes;
+    vector<ColumnarIndexEntry> entries;
+
+    ~ColumnarTableReader() {
+        if (data != NULL) {
+            munmap((void *)data, size);
+        }
+    }
+
+    void open(const string &fileName) {
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            cerr << "Cannot open the table file: " << fileName << endl;
+            throw 1;
+        }
+        size = st.st_size;
+        if (size > 0) {
+            void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                cerr << "Cannot map the table file: " << fileName << endl;
+                throw 1;
+            }
+            data = (const char *)p;
+        }
+        ::close(fd);
+
+        ColumnarFooter footer;
+        if (size < sizeof(columnarMagic) + sizeof(footer) ||
+            memcmp(data, columnarMagic, sizeof(columnarMagic)) != 0) {
+            broken(fileName);
+        }
+        memcpy(&footer, data + size - sizeof(footer), sizeof(footer));
+        uint64_t indexEnd = size - sizeof(footer);
+        if (memcmp(footer.magic, columnarMagic, sizeof(columnarMagic)) != 0 ||
+            footer.indexOffset > indexEnd ||
+            footer.nChunks > (indexEnd - footer.indexOffset) /
+                                 sizeof(ColumnarIndexEntry)) {
+            broken(fileName);
+        }
+        indexOffset = footer.indexOffset;
+        entries.resize(footer.nChunks);
+        memcpy(entries.data(), data + footer.indexOffset,
+               footer.nChunks * sizeof(ColumnarIndexEntry));
+        const char *p = data + footer.indexOffset +
+                        footer.nChunks * sizeof(ColumnarIndexEntry);
+        const char *end = data + indexEnd;
+        for (uint64_t i = 0; i < footer.nChromosomes; i++) {
+            uint32_t length;
+            if (end - p < (long long int)sizeof(length)) {
+                broken(fileName);
+            }
+            memcpy(&length, p, sizeof(length));
+            p += sizeof(length);
+            if ((uint64_t)(end - p) < length) {
+                broken(fileName);
+            }
+            chromosomes.emplace_back(p, length);
+            p += length;
+        }
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].chromosome >= chromosomes.size() ||
+                entries[i].offset >= footer.indexOffset) {
+                broken(fileName);
+            }
+        }
+    }
+
+    /**
+     * decode the selected columns of chunk i.
+     */
+    void readChunk(size_t i, ColumnarChunk &chunk, int columns) {
+        const ColumnarIndexEntry &entry = entries[i];
+        uint64_t end = i + 1 < entries.size() ? entries[i + 1].offset
+                                              : indexOffset;
+        if (end < entry.offset) {
+            cerr << "The table file has a broken chunk." << endl;
+            throw 1;
+        }
+        chunk.decode(data + entry.offset, data + end, columns);
+        chunk.chromosome = chromosomes[entry.chromosome];
+    }
+};
+
+#endif // COLUMNAR_3N_TABLE_H
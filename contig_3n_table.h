@@ -0,0 +1,149 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTIG_3N_TABLE_H
+#define CONTIG_3N_TABLE_H
+
+#include "utility_3n_table.h"
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+/**
+ * the contigs of the reference file by name. the id of a contig is its index
+ * in ChromosomeFilePositions (sorted by name), which is used by Positions and
+ * the parsed alignments instead of the name. the contigs in the header of the
+ * alignment file (@SQ lines or BAM references) are checked against it.
+ */
+class ContigDictionary {
+  private:
+    const ChromosomeFilePositions *chromosomePos = NULL;
+    unordered_map<string, int> ids;
+
+  public:
+    void open(const ChromosomeFilePositions &inputChromosomePos) {
+        chromosomePos = &inputChromosomePos;
+        ids.clear();
+        ids.reserve(chromosomePos->pos.size());
+        for (size_t i = 0; i < chromosomePos->pos.size(); i++) {
+            ids[chromosomePos->pos[i].chromosome] = i;
+        }
+    }
+
+    /**
+     * return the id of contig name, or -1 if it is not in the reference file.
+     */
+    int find(const string &name) const {
+        unordered_map<string, int>::const_iterator it = ids.find(name);
+        return it == ids.end() ? -1 : it->second;
+    }
+
+    /**
+     * return the id of contig name, throw if it is not in the reference file.
+     */
+    int get(const string &name) const {
+        int id = find(name);
+        if (id < 0) {
+            cerr << "Cannot find the chromosome: " << name
+                 << " in reference file." << endl;
+            throw 1;
+        }
+        return id;
+    }
+
+    /**
+     * check the contig of the alignment header and return its id. a contig
+     * which is not in the reference file is allowed (-1) until an alignment
+     * is on it, but it must have the same length as the reference.
+     */
+    int check(const string &name, long long int length) const {
+        int id = find(name);
+        if (id >= 0 && chromosomePos->pos[id].length != length) {
+            cerr << "The length of chromosome " << name << " is " << length
+                 << " in the alignment file, but "
+                 << chromosomePos->pos[id].length
+                 << " in reference file. Please use the same reference as "
+                    "the alignment."
+                 << endl;
+            throw 1;
+        }
+        return id;
+    }
+
+    /**
+     * check the @SQ line of SAM header and return the id of its contig, or -1.
+     * other lines are ignored.
+     */
+    int checkHeaderLine(const char *line, const char *end) const {
+        if (end - line < 3 || memcmp(line, "@SQ", 3) != 0) {
+            return -1;
+        }
+        string name;
+        long long int length = -1;
+        const char *field = line;
+        while (field < end) {
+            const char *fieldEnd = (const char *)memchr(field, '\t', end - field);
+            if (fieldEnd == NULL) {
+                fieldEnd = end;
+            }
+            if (fieldEnd - field > 3 && memcmp(field, "SN:", 3) == 0) {
+                name.assign(field + 3, fieldEnd - field - 3);
+            } else if (fieldEnd - field > 3 && memcmp(field, "LN:", 3) == 0) {
+                length = parseInteger(field + 3, fieldEnd);
+            }
+            field = fieldEnd + 1;
+        }
+        if (name.empty() || length < 0) {
+            return -1;
+        }
+        return check(name, length);
+    }
+};
+
+/**
+ * the last contig found in ContigDictionary, for the alignments of one thread.
+ * the alignments are grouped by contig, so a lookup usually only compares the
+ * name with the last one.
+ */
+class ContigCache {
+  private:
+    string name;
+    int id = -1;
+
+  public:
+    const ContigDictionary *dictionary = NULL;
+
+    /**
+     * return the id of the contig name of length, throw if it is not in the
+     * reference file.
+     */
+    inline int get(const char *inputName, size_t length) {
+        if (length != name.size() || memcmp(inputName, name.data(), length) != 0) {
+            string newName(inputName, length);
+            id = dictionary->get(newName);
+            name.swap(newName);
+        }
+        return id;
+    }
+};
+
+#endif // CONTIG_3N_TABLE_H
@@ -17,19 +17,62 @@
  * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "position_3n_table.h"
+#include "merge_3n_table.h"
+#include "pipeline_3n_table.h"
 #include <getopt.h>
 
 using namespace std;
 
-const int inf = 1234567890;
 string refFileName;
-bool uniqueOnly = false;
-bool multipleOnly = false;
+string alignmentFileName;
+vector<string> sampleFileNames; // all -i, more than one are samples.
+bool longSamples = false;
+bool contigParallel = false;
+bool binaryOutput = false;
+bool unsortedInput = false;
+long long int unsortedMemory = defaultUnsortedMemory; // MB
+bool countUnique = false;
+bool countMultiple = false;
+char baseChangeFrom = 'C';
+char baseChangeTo = 'T';
+string statsFileName;
+bool showProgress = false;
+string checkpointDirectory; // --checkpoint, empty if it is not set.
+string regionFileName;      // --regions, empty if it is not set.
+string command; // the command line, written to the stats.
+RunStats *runStats = NULL; // set by --stats or --progress.
+int nThreads = 1;
+
+/**
+ * one table to output: the reads it counts (u: unique, m: multiple mapped),
+ * and the output file ("-" for standard output).
+ */
+class TableOption {
+  public:
+    char mode;
+    string fileName;
+};
+vector<TableOption> tables;
 
 
 void printHelp(const char *s) {
-    printf("Usage: %s u|m <alignment file>\n", s);
+    printf("Usage: %s [options] u|m <reference file>\n", s);
+    printf("       %s [options] -t u|m:<file> [-t u|m:<file> ...] <reference file>\n", s);
+    printf("       %s index <reference file>  (make the reference cache)\n", s);
+    printf("       %s view <table file> [chr[:begin-end]]  (output the binary table as tsv)\n", s);
+    printf("  -i, --input <file>        alignment file (SAM or BAM, - or default: standard input), can be repeated to count the sorted files of several samples in one pass\n");
+    printf("  -p, --threads <int>       number of threads to parse the alignments (default: 1)\n");
+    printf("  -c, --contig-parallel     count the contigs of a sorted and indexed BAM file (-i) in parallel\n");
+    printf("  -t, --table u|m:<file>    count a table of unique (u) or multiple mapped (m) reads to file (- for standard output), can be repeated to count tables in one pass\n");
+    printf("      --long                with several inputs, output one row of each sample (chr, pos, strand, file, converted, unconverted) instead of the columns of each sample\n");
+    printf("  -b, --binary              output the binary columnar table instead of tsv\n");
+    printf("  -U, --unsorted            the alignments are not sorted, count them with temporary files\n");
+    printf("      --max-memory <int>    memory (MB) to count the unsorted alignments before using temporary files (default: %lld)\n", defaultUnsortedMemory);
+    printf("      --base-change <X,Y>   the base change to count, X in reference to Y in reads (default: C,T)\n");
+    printf("      --stats <file>        write the run statistics (time of each stage, records, bases, contigs) as JSON\n");
+    printf("      --progress            print the throughput and the current contig to standard error every 10 s\n");
+    printf("      --regions <bed>       only count and output the regions of the BED file, a sorted and indexed BAM file (-i) is read from the regions only\n");
+    printf("      --checkpoint <dir>    write the output of each contig to dir, and resume from the unfinished contigs if the run is killed (needs -i <file>)\n");
     printf("example: %s u /mnt/ramdisk/rna/ref/Homo_sapiens.GRCh38.dna.primary_assembly.fa\n", s);
     exit(-1);
 }
@@ -41,109 +84,508 @@ bool fileExist(string &filename) {
 
 void parseOptions(int argc, const char **argv) {
     // ./hisat-3n-table u /mnt/ramdisk/rna/ref/Homo_sapiens.GRCh38.dna.primary_assembly.fa
-    if (argc != 3) printHelp(argv[0]);
-    uniqueOnly = argv[1][0] == 'u';
-    multipleOnly = argv[1][0] == 'm';
-    if (!uniqueOnly && !multipleOnly) printHelp(argv[0]);
-    refFileName = argv[2];
+    static struct option longOptions[] = {
+        {"input", required_argument, 0, 'i'},
+        {"threads", required_argument, 0, 'p'},
+        {"contig-parallel", no_argument, 0, 'c'},
+        {"table", required_argument, 0, 't'},
+        {"binary", no_argument, 0, 'b'},
+        {"unsorted", no_argument, 0, 'U'},
+        {"max-memory", required_argument, 0, 'M'},
+        {"base-change", required_argument, 0, 'B'},
+        {"stats", required_argument, 0, 'S'},
+        {"progress", no_argument, 0, 'P'},
+        {"long", no_argument, 0, 'L'},
+        {"checkpoint", required_argument, 0, 'K'},
+        {"regions", required_argument, 0, 'R'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}};
+    int option;
+    while ((option = getopt_long(argc, (char *const *)argv, "i:p:ct:bUh", longOptions,
+                                 NULL)) != -1) {
+        switch (option) {
+        case 'i':
+            alignmentFileName = optarg;
+            sampleFileNames.push_back(optarg);
+            break;
+        case 'c':
+            contigParallel = true;
+            break;
+        case 't': {
+            TableOption table;
+            table.mode = optarg[0];
+            if ((table.mode != 'u' && table.mode != 'm') || optarg[1] != ':' ||
+                optarg[2] == '\0')
+                printHelp(argv[0]);
+            table.fileName = optarg + 2;
+            tables.push_back(table);
+            break;
+        }
+        case 'b':
+            binaryOutput = true;
+            break;
+        case 'U':
+            unsortedInput = true;
+            break;
+        case 'M':
+            unsortedMemory = atoll(optarg);
+            if (unsortedMemory < 1) printHelp(argv[0]);
+            break;
+        case 'B': {
+            string bases = optarg;
+            if (bases.size() != 3 || bases[1] != ',')
+                printHelp(argv[0]);
+            baseChangeFrom = toupper(bases[0]);
+            baseChangeTo = toupper(bases[2]);
+            if (strchr("ACGT", baseChangeFrom) == NULL ||
+                strchr("ACGT", baseChangeTo) == NULL ||
+                baseChangeFrom == baseChangeTo)
+                printHelp(argv[0]);
+            break;
+        }
+        case 'S':
+            statsFileName = optarg;
+            break;
+        case 'P':
+            showProgress = true;
+            break;
+        case 'L':
+            longSamples = true;
+            break;
+        case 'K':
+            checkpointDirectory = optarg;
+            break;
+        case 'R':
+            regionFileName = optarg;
+            break;
+        case 'p':
+            nThreads = atoi(optarg);
+            if (nThreads < 1) printHelp(argv[0]);
+            break;
+        default:
+            printHelp(argv[0]);
+        }
+    }
+    if (tables.empty()) {
+        // u|m <reference file>, one table to standard output.
+        if (argc - optind != 2) printHelp(argv[0]);
+        TableOption table;
+        table.mode = argv[optind][0];
+        table.fileName = "-";
+        if (table.mode != 'u' && table.mode != 'm') printHelp(argv[0]);
+        tables.push_back(table);
+        optind++;
+    }
+    if (argc - optind != 1) printHelp(argv[0]);
+    for (size_t t = 0; t < tables.size(); t++) {
+        countUnique |= tables[t].mode == 'u';
+        countMultiple |= tables[t].mode == 'm';
+    }
+    refFileName = argv[optind];
     if (!fileExist(refFileName))
         cerr << "reference (FASTA) file is not exist." << endl, throw(1);
+    if (contigParallel && alignmentFileName.empty())
+        cerr << "--contig-parallel needs an indexed BAM file (-i)." << endl, throw(1);
+    if (contigParallel && unsortedInput)
+        cerr << "--contig-parallel needs a sorted BAM file, it cannot be used with --unsorted." << endl, throw(1);
+    if (sampleFileNames.size() > 1 && (contigParallel || unsortedInput || binaryOutput || nThreads > 1))
+        cerr << "Several inputs (-i) are merged in one thread, they cannot be used with -p, -c, -U or -b." << endl, throw(1);
+    if (!checkpointDirectory.empty() && (alignmentFileName.empty() || alignmentFileName == "-"))
+        cerr << "--checkpoint needs an alignment file (-i), it is read again from the first unfinished contig." << endl, throw(1);
+    if (!regionFileName.empty() && (sampleFileNames.size() > 1 || contigParallel || unsortedInput || nThreads > 1 || !checkpointDirectory.empty()))
+        cerr << "--regions reads one sorted input in one thread, it cannot be used with several inputs, -p, -c, -U or --checkpoint." << endl, throw(1);
+    if (!checkpointDirectory.empty() && (sampleFileNames.size() > 1 || unsortedInput || (nThreads > 1 && !contigParallel)))
+        cerr << "--checkpoint counts one sorted input in one thread or with -c, it cannot be used with several inputs, -p (without -c) or -U." << endl, throw(1);
 }
 
-Positions *positions;
-
-
 /**
- * give a SAM line, extract the chromosome and position information.
- * return true if the SAM line is mapped. return false if SAM line is not maped.
+ * the options which decide the output of the checkpoint parts, a run is only
+ * resumed with the same options and input. the input is the same file if its
+ * size, modification time and inode are the same.
  */
-bool getSAMChromosomePos(string line, string &chr, long long int &pos) {
-    int startPosition = 0;
-    int endPosition = 0;
-    int count = 0;
-
-    while ((endPosition = line.find("\t", startPosition)) != string::npos) {
-        if (count == 2) {
-            chr = line.substr(startPosition, endPosition - startPosition);
-        } else if (count == 3) {
-            pos =
-                stoll(line.substr(startPosition, endPosition - startPosition));
-            if (chr == "*") {
-                return false;
-            } else {
-                return true;
-            }
-        }
-        startPosition = endPosition + 1;
-        count++;
-    }
-    return false;
+string getCheckpointOptions() {
+    struct stat fileStat;
+    if (stat(alignmentFileName.c_str(), &fileStat) != 0) {
+        cerr << "Cannot open the alignment file: " << alignmentFileName << endl;
+        throw 1;
+    }
+    ostringstream options;
+    options << "reference=" << refFileName << " input=" << alignmentFileName
+            << " size=" << fileStat.st_size
+            << " modified=" << fileStat.st_mtim.tv_sec << '.'
+            << fileStat.st_mtim.tv_nsec << " inode=" << fileStat.st_ino
+            << " tables=";
+    for (size_t t = 0; t < tables.size(); t++) {
+        options << tables[t].mode;
+    }
+    options << " binary=" << binaryOutput << " base-change=" << baseChangeFrom
+            << ',' << baseChangeTo << " contig-parallel=" << contigParallel;
+    return options.str();
 }
 
-int hisat_3n_table() {
-    Positions positions(refFileName);
+/**
+ * count the regions of a sorted and indexed BAM file. the alignments of each
+ * reference are read from the index offset of its first region, and the
+ * reader skips forward to the next region when a region is finished.
+ */
+template <typename Policy>
+void countIndexedRegions(Positions<Policy> &positions, BGZFReader &reader,
+                         const BAMHeader &header, BAMIndex &index) {
+    RegionSet &regions = *positions.regions;
+    BAMRecord record;
+    StageTimer timer(stageParse);
+    for (size_t ref = 0; ref < header.names.size(); ref++) {
+        int contig = header.contigs[ref];
+        if (contig < 0 || !index.hasAlignments(ref)) {
+            continue;
+        }
+        size_t seekedRegion = SIZE_MAX;
+        while (!regions.finished(contig)) {
+            size_t next = regions.next[contig];
+            if (next != seekedRegion) {
+                uint64_t offset =
+                    index.getOffset(ref, regions.regions[contig][next].begin);
+                // in a reference, only skip forward, the alignments read
+                // before are counted.
+                if (seekedRegion == SIZE_MAX || offset > reader.tell()) {
+                    reader.seek(offset);
+                }
+                seekedRegion = next;
+            }
+            {
+                StageTimer inputTimer(stageInput);
+                if (!record.read(reader)) {
+                    break;
+                }
+            }
+            if (record.refID() != (int)ref) {
+                break;
+            }
+            if (!positions.moveToRegion(contig, record.location(),
+                                        record.coveredLength())) {
+                if (runStats != NULL) {
+                    runStats->reads.countOutOfRegions();
+                }
+                continue;
+            }
+            record.toAlignment(positions.tmpAlignment, header);
+            positions.appendPositions(positions.tmpAlignment);
+            if (runStats != NULL) {
+                runStats->reportProgress(positions.chromosome);
+            }
+        }
+    }
+}
 
+/**
+ * count the alignments from the input into positions and output them. with
+ * a checkpoint, the input is read from the first unfinished contig.
+ */
+template <typename Policy>
+void countAlignments(Positions<Policy> &positions, Checkpoint *checkpoint) {
     // main function, initially 2 load loadingBlockSize (2,000,000) bp of
     // reference, set reloadPos to 1 loadingBlockSize, then load SAM data. when
     // the samPos larger than the reloadPos load 1 loadingBlockSize bp of
     // reference. when the samChromosome is different to current chromosome,
     // finish all sam position and output all.
-    istream *alignmentFile = &cin;
+    if (contigParallel) {
+        ContigPipeline<Policy> pipeline(positions, alignmentFileName, nThreads,
+                                        checkpoint);
+        pipeline.run();
+        return;
+    }
 
-    string *line;         // temporary string to get SAM line.
-    string samChromosome; // the chromosome name of current SAM line.
-    long long int samPos; // the position of current SAM line.
-    long long int
-        reloadPos; // the position in reference that we need to reload.
-    long long int lastPos = 0; // the position on last SAM line. compare lastPos
-                               // with samPos to make sure the SAM is sorted.
+    if (sampleFileNames.size() > 1) {
+        SampleMerger<Policy> merger(positions);
+        merger.run(sampleFileNames);
+        positions.startOutput(true);
+        return;
+    }
 
-    static char buff[1000007];
-    while (true) {
-        if (fgets(buff, sizeof(buff), stdin) == NULL) break;
-        string line(buff);
+    if (checkpoint != NULL && checkpoint->finished) {
+        return; // only the parts are written.
+    }
+    // the offset of the first record after the finished parts.
+    long long int resumeOffset = checkpoint != NULL && !checkpoint->parts.empty()
+                                     ? checkpoint->parts.back().offset
+                                     : -1;
 
-        if (line.empty() || line.front() == '@') {
-            continue;
+    FILE *alignmentFile = openAlignmentFile(alignmentFileName, "rb");
+
+    if (nThreads > 1) {
+        ParsePipeline<Policy> pipeline(positions, nThreads);
+        pipeline.run(alignmentFile);
+        positions.startOutput(true);
+        return;
+    }
+
+    if (isBGZF(alignmentFile)) {
+        // BAM input, decode the records directly.
+        BGZFReader reader;
+        reader.open(alignmentFile);
+        BAMHeader header;
+        header.load(reader);
+        header.setContigs(positions.contigs);
+        if (resumeOffset >= 0) {
+            reader.seek(resumeOffset);
         }
-        // if the SAM line is empty or unmapped, get the next SAM line.
-        if (!getSAMChromosomePos(line, samChromosome, samPos)) continue;
-        // if the samChromosome is different than current positions' chromosome,
-        // finish all SAM line. then load a new reference chromosome.
-        if (samChromosome != positions.chromosome) {
-            // if (positions.chromosome.size() < 5 && samChromosome.size() < 5)
-            //     cerr << "chromosome changed from " << positions.chromosome << " to "
-            //         << samChromosome << endl << flush;
+        string indexFileName;
+        if (positions.regions != NULL && !alignmentFileName.empty() &&
+            alignmentFileName != "-" &&
+            BAMIndex::findIndexFile(alignmentFileName, indexFileName)) {
+            BAMIndex index;
+            index.load(indexFileName);
+            if (index.firstOffset.size() != header.names.size()) {
+                cerr << "The BAM index does not match " << alignmentFileName
+                     << endl;
+                throw 1;
+            }
+            countIndexedRegions(positions, reader, header, index);
             positions.startOutput(true);
+            return;
+        }
+        BAMRecord record;
+        StageTimer timer(stageParse);
+        while (true) {
+            {
+                StageTimer inputTimer(stageInput);
+                if (checkpoint != NULL) {
+                    checkpoint->inputOffset = reader.tell();
+                }
+                if (!record.read(reader)) {
+                    break;
+                }
+            }
+            int ref = record.refID();
+            if (ref < 0) {
+                if (runStats != NULL) {
+                    runStats->reads.countUnmapped();
+                }
+                continue;
+            }
+            long long int samPos = record.location();
+            int contig = header.getContig(ref);
+            if (positions.regions == NULL) {
+                positions.moveTo(contig, samPos);
+            } else if (!positions.moveToRegion(contig, samPos,
+                                               record.coveredLength())) {
+                if (runStats != NULL) {
+                    runStats->reads.countOutOfRegions();
+                }
+                continue;
+            }
+            record.toAlignment(positions.tmpAlignment, header);
+            positions.appendPositions(positions.tmpAlignment);
+            if (runStats != NULL) {
+                runStats->reportProgress(positions.chromosome);
+            }
+        }
+        positions.startOutput(true);
+        return;
+    }
 
-            int meetNext;
-            positions.loadNewChromosome(samChromosome, meetNext);
-            reloadPos = meetNext ? inf : loadingBlockSize;
-            lastPos = 0;
-        }
-        // if the samPos is larger than reloadPos, load 1 loadingBlockSize bp in
-        // from reference.
-        while (samPos > reloadPos) {
-            positions.startOutput();
-            int meetNext;
-            positions.loadMore(meetNext);
-            reloadPos += meetNext ? inf : loadingBlockSize;
-        }
-        if (lastPos > samPos) {
-            cerr << "The input alignment file is not sorted. Please use sorted "
-                    "SAM "
-                    "file as alignment file."
-                 << endl;
-            throw 1;
+    if (resumeOffset >= 0 && fseeko(alignmentFile, resumeOffset, SEEK_SET) != 0) {
+        cerr << "Cannot seek in the alignment file." << endl;
+        throw 1;
+    }
+    SAMBlockReader reader;
+    reader.open(alignmentFile);
+    SAMTokenizer tokenizer;
+    vector<char> buffer;
+    const char *block;
+    size_t blockLength;
+    StageTimer timer(stageParse);
+    while (true) {
+        {
+            StageTimer inputTimer(stageInput);
+            if (!reader.read(buffer, block, blockLength)) {
+                break;
+            }
+        }
+        tokenizer.tokenize(block, blockLength);
+        for (size_t i = 0; i < tokenizer.records.size(); i++) {
+            const SAMRecordView &record = tokenizer.records[i];
+            const char *line = block + record.begin;
+            if (record.length == 0) {
+                continue;
+            }
+            if (line[0] == '@') {
+                positions.contigs.checkHeaderLine(line, line + record.length);
+                continue;
+            }
+            if (checkpoint != NULL) {
+                checkpoint->inputOffset = reader.blockOffset + record.begin;
+            }
+            // if the SAM line is unmapped, it is skipped.
+            positions.appendSync(line,
+                                 tokenizer.fieldEnds.data() + record.firstField,
+                                 record.nFields);
+        }
+        if (runStats != NULL) {
+            runStats->reportProgress(positions.chromosome);
         }
-        positions.appendSync(line);
-        lastPos = samPos;
     }
 
     // prepare to close everything.
 
     // move all position to outputPool
     positions.startOutput(true);
+}
+
+/**
+ * count the tables with the counting kernels of Policy.
+ */
+template <typename Policy> int hisat_3n_table() {
+    vector<char> tableModes;
+    for (size_t t = 0; t < tables.size(); t++) {
+        tableModes.push_back(tables[t].mode);
+    }
+    Positions<Policy> positions(refFileName, tableModes);
+    if (sampleFileNames.size() > 1) {
+        positions.setTables(tableModes, sampleFileNames.size());
+        positions.longSamples = longSamples;
+        positions.sampleNames = sampleFileNames;
+    }
+    if (runStats != NULL) {
+        positions.readStats = &runStats->reads;
+    }
+    vector<unique_ptr<OutputWriter>> outputs;
+    for (size_t t = 0; t < tables.size(); t++) {
+        int fd = STDOUT_FILENO;
+        if (tables[t].fileName != "-") {
+            fd = open(tables[t].fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                      0644);
+            if (fd < 0) {
+                cerr << "Cannot open the output file: " << tables[t].fileName
+                     << endl;
+                throw 1;
+            }
+        }
+        outputs.emplace_back(new OutputWriter());
+        outputs.back()->open(fd, true, binaryOutput);
+        positions.outs[t] = outputs.back().get();
+    }
+    vector<unique_ptr<UnsortedCounter>> counters;
+    if (unsortedInput) {
+        for (size_t t = 0; t < tables.size(); t++) {
+            counters.emplace_back(
+                new UnsortedCounter(max(1LL, unsortedMemory / (long long)tables.size())));
+            positions.unsorted.push_back(counters.back().get());
+        }
+    }
+    RegionSet regions;
+    if (!regionFileName.empty()) {
+        regions.load(regionFileName, positions.contigs,
+                     positions.chromosomePos.pos.size());
+        positions.regions = &regions;
+    }
+    Checkpoint checkpoint;
+    if (!checkpointDirectory.empty()) {
+        checkpoint.open(checkpointDirectory, getCheckpointOptions(),
+                        tables.size(), binaryOutput);
+        if (!contigParallel) {
+            positions.checkpoint = &checkpoint;
+        }
+    }
+    countAlignments(positions, checkpointDirectory.empty() ? NULL : &checkpoint);
+    if (positions.checkpoint != NULL) {
+        // the counted contigs are in the parts, concatenate them.
+        if (!checkpoint.finished) {
+            checkpoint.finish();
+        }
+        vector<OutputWriter *> finalOutputs;
+        for (size_t t = 0; t < tables.size(); t++) {
+            finalOutputs.push_back(outputs[t].get());
+        }
+        checkpoint.stitch(finalOutputs);
+    }
+    for (size_t t = 0; t < tables.size(); t++) {
+        if (unsortedInput) {
+            StageTimer timer(stageOutput);
+            counters[t]->output<Policy>(positions.refFile, positions.chromosomePos,
+                                *outputs[t]);
+        }
+        {
+            StageTimer timer(stageOutput);
+            outputs[t]->close();
+        }
+        if (tables[t].fileName != "-" && close(outputs[t]->getFd()) != 0) {
+            cerr << "Cannot write the output file: " << tables[t].fileName
+                 << endl;
+            throw 1;
+        }
+    }
+    if (!checkpointDirectory.empty()) {
+        checkpoint.remove(); // the tables are written.
+    }
+    if (runStats != NULL) {
+        vector<string> tableNames;
+        for (size_t t = 0; t < tables.size(); t++) {
+            tableNames.push_back(string(1, tables[t].mode) + ":" +
+                                 tables[t].fileName);
+            runStats->rows.push_back(outputs[t]->rows);
+        }
+        if (!statsFileName.empty()) {
+            runStats->write(statsFileName, command, tableNames,
+                            positions.chromosomePos);
+        }
+    }
+    return 0;
+}
+
+/**
+ * run hisat_3n_table with the Policy chosen from the options.
+ */
+class TableCounter {
+  public:
+    template <typename Policy> int run() { return hisat_3n_table<Policy>(); }
+};
+
+/**
+ * output the binary table as tsv. region is chr or chr:begin-end (1-based,
+ * inclusive), empty for the whole table. only the chunks overlap with region
+ * are decoded.
+ */
+int hisat_3n_table_view(const string &tableFileName, const string &region) {
+    string chromosome = region;
+    long long int begin = 1;
+    long long int end = LLONG_MAX;
+    size_t colon = region.rfind(':');
+    if (colon != string::npos) {
+        const char *range = region.c_str() + colon + 1;
+        int n = 0;
+        if (sscanf(range, "%lld-%lld%n", &begin, &end, &n) == 2 &&
+            range[n] == '\0') {
+            chromosome = region.substr(0, colon);
+        } else {
+            begin = 1;
+            end = LLONG_MAX;
+        }
+    }
+
+    ColumnarTableReader table;
+    table.open(tableFileName);
+    OutputWriter output;
+    output.open(STDOUT_FILENO, true);
+    ColumnarChunk chunk;
+    for (size_t i = 0; i < table.entries.size(); i++) {
+        const ColumnarIndexEntry &entry = table.entries[i];
+        if (!chromosome.empty() &&
+            (table.chromosomes[entry.chromosome] != chromosome ||
+             entry.lastLocation < begin || entry.firstLocation > end)) {
+            continue;
+        }
+        table.readChunk(i, chunk, allColumns);
+        output.setChromosome(entry.chromosome, chunk.chromosome);
+        for (size_t j = 0; j < chunk.nRows; j++) {
+            if (chunk.locations[j] < begin || chunk.locations[j] > end) {
+                continue;
+            }
+            output.writeRow(chunk.locations[j], chunk.getStrand(j),
+                            chunk.converted[j], chunk.unconverted[j]);
+        }
+    }
+    output.close();
     return 0;
 }
 
@@ -152,8 +594,26 @@ int main(int argc, const char **argv) {
     int ret = 0;
 
     try {
+        if (argc == 3 && strcmp(argv[1], "index") == 0) {
+            refFileName = argv[2];
+            ReferenceFile::buildCache(refFileName);
+            return 0;
+        }
+        if ((argc == 3 || argc == 4) && strcmp(argv[1], "view") == 0) {
+            return hisat_3n_table_view(argv[2], argc == 4 ? argv[3] : "");
+        }
         parseOptions(argc, argv);
-        ret = hisat_3n_table();
+        RunStats stats;
+        if (!statsFileName.empty() || showProgress) {
+            stats.progress = showProgress;
+            runStats = &stats;
+        }
+        for (int i = 0; i < argc; i++) {
+            command += string(i > 0 ? " " : "") + argv[i];
+        }
+        TableCounter counter;
+        ret = dispatchPolicy(baseChangeFrom, baseChangeTo, countUnique,
+                             countMultiple, counter);
     } catch (std::exception &e) {
         cerr << "Error: Encountered exception: '" << e.what() << "'" << endl;
         cerr << "Command: ";
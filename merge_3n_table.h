@@ -0,0 +1,245 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MERGE_3N_TABLE_H
+#define MERGE_3N_TABLE_H
+
+#include "bam_3n_table.h"
+#include "position_3n_table.h"
+#include "stats_3n_table.h"
+#include "tokenizer_3n_table.h"
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * the order of contigs in the sorted inputs: the order of the first header
+ * which has the contig, or of the first alignment on it if no header has it.
+ */
+class ContigOrder {
+  public:
+    vector<int> rank; // of each contig id, -1 if it is not seen yet.
+    int nRanks = 0;
+
+    inline int get(int contig) {
+        if (rank[contig] < 0) {
+            rank[contig] = nRanks++;
+        }
+        return rank[contig];
+    }
+};
+
+/**
+ * one sorted SAM or BAM input of the samples. it reads the placed
+ * alignments one by one, the unplaced ones are skipped.
+ */
+template <typename Policy> class SampleInput {
+  private:
+    FILE *file = NULL;
+    bool bam = false;
+    const ContigDictionary *contigs = NULL;
+    ContigOrder *order = NULL;
+    BGZFReader bamReader;
+    BAMHeader header;
+    BAMRecord record;
+    SAMBlockReader samReader;
+    SAMTokenizer tokenizer;
+    vector<char> buffer;
+    const char *block = NULL;
+    size_t nextLine = 0; // the next record in tokenizer.
+
+    /**
+     * get the next SAM line of the input. return false at the end.
+     */
+    bool readLine(const char *&line, const SAMRecordView *&view) {
+        while (nextLine == tokenizer.records.size()) {
+            StageTimer timer(stageInput);
+            size_t blockLength;
+            if (!samReader.read(buffer, block, blockLength)) {
+                return false;
+            }
+            tokenizer.tokenize(block, blockLength);
+            nextLine = 0;
+        }
+        view = &tokenizer.records[nextLine++];
+        line = block + view->begin;
+        return true;
+    }
+
+    /**
+     * read the next record to alignment. return false at the end, set placed
+     * to false if the record is not placed.
+     */
+    bool readRecord(bool &placed) {
+        if (bam) {
+            {
+                StageTimer timer(stageInput);
+                if (!record.read(bamReader)) {
+                    return false;
+                }
+            }
+            placed = record.refID() >= 0;
+            if (placed) {
+                record.toAlignment(alignment, header);
+            }
+            return true;
+        }
+        const char *line;
+        const SAMRecordView *view;
+        if (!readLine(line, view)) {
+            return false;
+        }
+        placed = false;
+        if (view->length == 0) {
+            return true;
+        }
+        if (line[0] == '@') {
+            int contig = contigs->checkHeaderLine(line, line + view->length);
+            if (contig >= 0) {
+                order->get(contig);
+            }
+            return true;
+        }
+        placed = alignment.parse<Policy>(
+            line, tokenizer.fieldEnds.data() + view->firstField, view->nFields);
+        if (!placed && runStats != NULL) {
+            runStats->reads.countUnmapped();
+        }
+        return true;
+    }
+
+  public:
+    string fileName;
+    Alignment alignment; // the current alignment.
+    int rank = -1;       // the rank of its contig in order.
+
+    ~SampleInput() {
+        bamReader.close();
+        samReader.close();
+        if (file != NULL && file != stdin) {
+            fclose(file);
+        }
+    }
+
+    void open(const string &inputFileName,
+              const ContigDictionary &inputContigs, ContigOrder &inputOrder) {
+        fileName = inputFileName;
+        contigs = &inputContigs;
+        order = &inputOrder;
+        alignment.contigCache.dictionary = contigs;
+        file = openAlignmentFile(fileName, "rb");
+        bam = isBGZF(file);
+        if (!bam) {
+            samReader.open(file);
+            return;
+        }
+        bamReader.open(file);
+        header.load(bamReader);
+        header.setContigs(*contigs);
+        for (size_t ref = 0; ref < header.contigs.size(); ref++) {
+            if (header.contigs[ref] >= 0) {
+                order->get(header.contigs[ref]);
+            }
+        }
+    }
+
+    /**
+     * read the next placed alignment. return false at the end of input.
+     */
+    bool next() {
+        bool placed;
+        while (readRecord(placed)) {
+            if (!placed) {
+                if (bam && runStats != NULL) {
+                    runStats->reads.countUnmapped();
+                }
+                continue;
+            }
+            int lastRank = rank;
+            rank = order->get(alignment.contig);
+            if (rank < lastRank) {
+                cerr << "The contigs of alignment file " << fileName
+                     << " are not in the order of the other inputs. Please "
+                        "sort the inputs with the same reference."
+                     << endl;
+                throw 1;
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+/**
+ * count several sorted inputs (samples) in one pass of the reference: the
+ * alignments are merged by contig and location (k-way), and each one is
+ * counted in the tables of its sample in positions.
+ */
+template <typename Policy> class SampleMerger {
+  private:
+    Positions<Policy> &positions;
+    vector<unique_ptr<SampleInput<Policy>>> inputs;
+    ContigOrder order;
+
+  public:
+    SampleMerger(Positions<Policy> &inputPositions)
+        : positions(inputPositions) {}
+
+    /**
+     * count the inputs of fileNames, sample i is fileNames[i]. the final
+     * output of the last chromosome is left to the caller.
+     */
+    void run(const vector<string> &fileNames) {
+        order.rank.assign(positions.chromosomePos.pos.size(), -1);
+        typedef pair<pair<int, long long int>, int> Head; // key and input.
+        priority_queue<Head, vector<Head>, greater<Head>> heads;
+        StageTimer timer(stageParse);
+        for (size_t i = 0; i < fileNames.size(); i++) {
+            // the headers are read in the order of inputs.
+            inputs.emplace_back(new SampleInput<Policy>());
+            inputs[i]->open(fileNames[i], positions.contigs, order);
+            if (inputs[i]->next()) {
+                heads.push(Head(make_pair(inputs[i]->rank,
+                                          inputs[i]->alignment.location),
+                                i));
+            }
+        }
+        while (!heads.empty()) {
+            int i = heads.top().second;
+            heads.pop();
+            SampleInput<Policy> &input = *inputs[i];
+            positions.moveTo(input.alignment.contig, input.alignment.location);
+            positions.sample = i;
+            positions.appendPositions(input.alignment);
+            if (input.next()) {
+                heads.push(Head(make_pair(input.rank, input.alignment.location),
+                                i));
+            }
+            if (runStats != NULL) {
+                runStats->reportProgress(positions.chromosome);
+            }
+        }
+        positions.sample = 0;
+    }
+};
+
+#endif // MERGE_3N_TABLE_H
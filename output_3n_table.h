@@ -0,0 +1,436 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OUTPUT_3N_TABLE_H
+#define OUTPUT_3N_TABLE_H
+
+#include "columnar_3n_table.h"
+#include "utility_3n_table.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+const int outputBufferSize = 1 << 20;
+const int outputBufferCount = 4;
+
+/**
+ * a block of formatted output.
+ */
+class OutputBuffer {
+  public:
+    vector<char> data;
+    size_t length = 0;
+
+    OutputBuffer() : data(outputBufferSize) {}
+};
+
+/**
+ * format the table rows into large buffers and write them to a file
+ * descriptor with write(2). in async mode, the full buffers are written by a
+ * background thread, so writing a block overlaps with counting the next one.
+ * in binary mode, the rows are written as the binary columnar table.
+ */
+class OutputWriter {
+  private:
+    int fd = -1;
+    bool async = false;
+    atomic<bool> failed{false}; // set by the writer thread if write(2) fails.
+    vector<unique_ptr<OutputBuffer>> buffers;
+    OutputBuffer *current = NULL;
+    SafeQueue<OutputBuffer *> fullBuffers;
+    SafeQueue<OutputBuffer *> freeBuffers;
+    thread writerThread;
+    int prefixChromosomeId = -1;
+    string prefix; // "chromosome\t" of the rows.
+    string chromosome;
+
+    bool binary = false;
+    bool indexed = false; // write the magic and the index of binary table.
+    uint64_t offset = 0;  // the bytes written.
+    ColumnarChunk chunk;
+    vector<char> chunkData;
+    vector<ColumnarChunkInfo> chunks;
+
+    /**
+     * write all of buffer to fd. return false if it fails.
+     */
+    bool writeBuffer(OutputBuffer *buffer) {
+        size_t done = 0;
+        while (done < buffer->length) {
+            ssize_t n = write(fd, buffer->data.data() + done,
+                              buffer->length - done);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            done += n;
+        }
+        buffer->length = 0;
+        return true;
+    }
+
+    void runWriter() {
+        OutputBuffer *buffer;
+        while (fullBuffers.popFront(buffer)) {
+            if (!failed && !writeBuffer(buffer)) {
+                failed = true;
+            }
+            buffer->length = 0;
+            freeBuffers.push(buffer);
+        }
+    }
+
+    /**
+     * write out the current buffer and get an empty one.
+     */
+    void flush() {
+        if (current->length == 0) {
+            return;
+        }
+        if (async) {
+            fullBuffers.push(current);
+            freeBuffers.popFront(current);
+        } else if (!writeBuffer(current)) {
+            failed = true;
+        }
+        if (failed) {
+            cerr << "Cannot write the output." << endl;
+            throw 1;
+        }
+    }
+
+    /**
+     * make sure there is n bytes of space in the current buffer.
+     */
+    inline char *reserve(size_t n) {
+        if (current->length + n > current->data.size()) {
+            flush();
+            if (n > current->data.size()) {
+                current->data.resize(n);
+            }
+        }
+        return current->data.data() + current->length;
+    }
+
+    inline void writeBytes(const void *p, size_t n) {
+        memcpy(reserve(n), p, n);
+        current->length += n;
+        offset += n;
+    }
+
+    /**
+     * write the rows in chunk as one chunk of binary table.
+     */
+    void flushChunk() {
+        if (chunk.nRows == 0) {
+            return;
+        }
+        ColumnarChunkInfo info;
+        info.chromosome = chunk.chromosome;
+        info.nRows = chunk.nRows;
+        info.firstLocation = chunk.locations.front();
+        info.lastLocation = chunk.locations.back();
+        info.offset = offset;
+        chunks.push_back(info);
+        chunkData.clear();
+        chunk.encode(chunkData);
+        writeBytes(chunkData.data(), chunkData.size());
+        chunk.clear();
+    }
+
+    /**
+     * write the index and footer of binary table.
+     */
+    void writeIndex() {
+        ColumnarFooter footer;
+        memset(&footer, 0, sizeof(footer));
+        footer.indexOffset = offset;
+        footer.nChunks = chunks.size();
+        vector<string> names;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            ColumnarIndexEntry entry;
+            memset(&entry, 0, sizeof(entry));
+            entry.chromosome =
+                find(names.begin(), names.end(), chunks[i].chromosome) -
+                names.begin();
+            if (entry.chromosome == names.size()) {
+                names.push_back(chunks[i].chromosome);
+            }
+            entry.nRows = chunks[i].nRows;
+            entry.firstLocation = chunks[i].firstLocation;
+            entry.lastLocation = chunks[i].lastLocation;
+            entry.offset = chunks[i].offset;
+            writeBytes(&entry, sizeof(entry));
+        }
+        for (size_t i = 0; i < names.size(); i++) {
+            uint32_t length = names[i].size();
+            writeBytes(&length, sizeof(length));
+            writeBytes(names[i].data(), length);
+        }
+        footer.nChromosomes = names.size();
+        memcpy(footer.magic, columnarMagic, sizeof(columnarMagic));
+        writeBytes(&footer, sizeof(footer));
+    }
+
+    /**
+     * write the decimal value to p, return the end of it.
+     */
+    static inline char *writeInteger(char *p, unsigned long long int value) {
+        static const char digitPairs[] =
+            "00010203040506070809101112131415161718192021222324"
+            "25262728293031323334353637383940414243444546474849"
+            "50515253545556575859606162636465666768697071727374"
+            "75767778798081828384858687888990919293949596979899";
+        char buff[24];
+        char *end = buff + sizeof(buff);
+        char *s = end;
+        while (value >= 100) {
+            int i = (value % 100) * 2;
+            value /= 100;
+            *--s = digitPairs[i + 1];
+            *--s = digitPairs[i];
+        }
+        if (value >= 10) {
+            int i = value * 2;
+            *--s = digitPairs[i + 1];
+            *--s = digitPairs[i];
+        } else {
+            *--s = '0' + value;
+        }
+        memcpy(p, s, end - s);
+        return p + (end - s);
+    }
+
+  public:
+    ~OutputWriter() {
+        if (writerThread.joinable()) {
+            fullBuffers.close();
+            writerThread.join();
+        }
+    }
+
+    /**
+     * write to outputFd. if inputAsync, start the writer thread. if
+     * inputBinary, write the binary table, with the index if inputIndexed
+     * (without it, the output is a part of a table, see writeFile).
+     */
+    void open(int outputFd, bool inputAsync, bool inputBinary = false,
+              bool inputIndexed = true) {
+        fd = outputFd;
+        async = inputAsync;
+        binary = inputBinary;
+        indexed = inputBinary && inputIndexed;
+        int nBuffers = async ? outputBufferCount : 1;
+        for (int i = 0; i < nBuffers; i++) {
+            buffers.emplace_back(new OutputBuffer());
+            freeBuffers.push(buffers.back().get());
+        }
+        freeBuffers.popFront(current);
+        if (async) {
+            writerThread = thread(&OutputWriter::runWriter, this);
+        }
+        if (indexed) {
+            writeBytes(columnarMagic, sizeof(columnarMagic));
+        }
+    }
+
+    inline bool isBinary() { return binary; }
+
+    inline int getFd() { return fd; }
+
+    long long int rows = 0; // the rows written.
+
+    /**
+     * the chunks written, with the offset in this output.
+     */
+    const vector<ColumnarChunkInfo> &getChunks() { return chunks; }
+
+    /**
+     * write out everything, and stop the writer thread.
+     */
+    void close() {
+        if (current == NULL) {
+            return;
+        }
+        if (binary) {
+            flushChunk();
+        }
+        if (indexed) {
+            writeIndex();
+        }
+        flush();
+        if (writerThread.joinable()) {
+            fullBuffers.close();
+            writerThread.join();
+        }
+        current = NULL;
+        if (failed) {
+            cerr << "Cannot write the output." << endl;
+            throw 1;
+        }
+    }
+
+    /**
+     * set the chromosome of the following rows.
+     */
+    inline void setChromosome(int chromosomeId, const string &name) {
+        if (chromosomeId != prefixChromosomeId) {
+            if (binary) {
+                flushChunk();
+                chunk.chromosome = name;
+            }
+            prefixChromosomeId = chromosomeId;
+            prefix = name + '\t';
+        }
+    }
+
+    /**
+     * append one row: chromosome, location, strand, converted count and
+     * unconverted count, separated by tab.
+     */
+    inline void writeRow(long long int location, char strand,
+                         unsigned long long int converted,
+                         unsigned long long int unconverted) {
+        rows++;
+        if (binary) {
+            chunk.append(location, strand, converted, unconverted);
+            if (chunk.nRows == columnarChunkRows) {
+                flushChunk();
+            }
+            return;
+        }
+        char *p = reserve(prefix.size() + 3 * 21 + 4);
+        char *start = p;
+        memcpy(p, prefix.data(), prefix.size());
+        p += prefix.size();
+        p = writeInteger(p, location);
+        *p++ = '\t';
+        *p++ = strand;
+        *p++ = '\t';
+        p = writeInteger(p, converted);
+        *p++ = '\t';
+        p = writeInteger(p, unconverted);
+        *p++ = '\n';
+        current->length += p - start;
+        offset += p - start;
+    }
+
+    /**
+     * append one row of nSamples: chromosome, location, strand, then the
+     * converted and unconverted count of each sample in counts. it is only
+     * written as tsv.
+     */
+    inline void writeSamplesRow(long long int location, char strand,
+                                const unsigned long long int *counts,
+                                int nSamples) {
+        rows++;
+        char *p = reserve(prefix.size() + (2 * nSamples + 1) * 21 + 4);
+        char *start = p;
+        memcpy(p, prefix.data(), prefix.size());
+        p += prefix.size();
+        p = writeInteger(p, location);
+        *p++ = '\t';
+        *p++ = strand;
+        for (int i = 0; i < 2 * nSamples; i++) {
+            *p++ = '\t';
+            p = writeInteger(p, counts[i]);
+        }
+        *p++ = '\n';
+        current->length += p - start;
+        offset += p - start;
+    }
+
+    /**
+     * append one row of a sample: chromosome, location, strand, sample,
+     * converted count and unconverted count. it is only written as tsv.
+     */
+    inline void writeSampleRow(long long int location, char strand,
+                               const string &sample,
+                               unsigned long long int converted,
+                               unsigned long long int unconverted) {
+        rows++;
+        char *p = reserve(prefix.size() + sample.size() + 3 * 21 + 5);
+        char *start = p;
+        memcpy(p, prefix.data(), prefix.size());
+        p += prefix.size();
+        p = writeInteger(p, location);
+        *p++ = '\t';
+        *p++ = strand;
+        *p++ = '\t';
+        memcpy(p, sample.data(), sample.size());
+        p += sample.size();
+        *p++ = '\t';
+        p = writeInteger(p, converted);
+        *p++ = '\t';
+        p = writeInteger(p, unconverted);
+        *p++ = '\n';
+        current->length += p - start;
+        offset += p - start;
+    }
+
+    /**
+     * append the content of file fileName. in binary mode, it is a part of
+     * table with fileChunks.
+     */
+    void writeFile(const string &fileName,
+                   const vector<ColumnarChunkInfo> &fileChunks) {
+        if (binary) {
+            flushChunk();
+            for (size_t i = 0; i < fileChunks.size(); i++) {
+                chunks.push_back(fileChunks[i]);
+                chunks.back().offset += offset;
+            }
+        }
+        int input = ::open(fileName.c_str(), O_RDONLY);
+        if (input < 0) {
+            cerr << "Cannot open file: " << fileName << endl;
+            throw 1;
+        }
+        while (true) {
+            char *p = reserve(outputBufferSize / 4);
+            ssize_t n = read(input, p, current->data.size() - current->length);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                ::close(input);
+                if (n < 0) {
+                    cerr << "Cannot read file: " << fileName << endl;
+                    throw 1;
+                }
+                return;
+            }
+            current->length += n;
+            offset += n;
+        }
+    }
+};
+
+#endif // OUTPUT_3N_TABLE_H
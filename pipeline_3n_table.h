@@ -0,0 +1,710 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIPELINE_3N_TABLE_H
+#define PIPELINE_3N_TABLE_H
+
+#include "bam_3n_table.h"
+#include "checkpoint_3n_table.h"
+#include "position_3n_table.h"
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+const int batchLineCount = 4096;
+const long long int contigRangeSize = 16000000; // split larger contigs.
+
+/**
+ * one mapped SAM line after parsing. its counting events are in the batch's
+ * increments from incBegin to incEnd.
+ */
+class ParsedRecord {
+  public:
+    int contig; // the id in ContigDictionary.
+    long long int location;
+    bool unique;
+    int incBegin;
+    int incEnd;
+    bool counted;   // if runStats is set, the read is counted,
+    int nConverted; // with nConverted converted bases.
+};
+
+/**
+ * a block of SAM lines (or BAM records) read together. the workers fill
+ * records and increments, then the aggregator applies them in the order of id.
+ */
+class AlignmentBatch {
+  public:
+    long long int id;
+    int nLines;
+    vector<char> text;    // the buffer of SAM lines read from a stream.
+    const char *textData; // SAM lines, textLength bytes, in text or mapped.
+    size_t textLength;
+    vector<char> bamData; // nLines BAM records, each with its block_size.
+    int bamLength;
+    vector<ParsedRecord> records;
+    size_t nRecords;
+    vector<PosIncrement> increments;
+    ReadStats reads; // the records of this batch, if runStats is set.
+
+    AlignmentBatch()
+        : id(0), nLines(0), textData(NULL), textLength(0), bamLength(0),
+          nRecords(0) {}
+};
+
+/**
+ * read SAM lines on one thread, parse them on nThreads worker threads, and
+ * apply the counting events to positions on the calling thread. the batches
+ * are applied in input order, so the reference window moves exactly like the
+ * single thread run, and a block is only output after all SAM lines before it
+ * are counted.
+ */
+template <typename Policy> class ParsePipeline {
+  private:
+    Positions<Policy> &positions;
+    int nThreads;
+    bool bamInput;
+    unique_ptr<ParallelBGZFReader> bamReader;
+    BAMHeader header;
+    vector<AlignmentBatch> batches;
+    SafeQueue<AlignmentBatch *> freeBatches;
+    SafeQueue<AlignmentBatch *> parseQueue;
+    SafeQueue<AlignmentBatch *> resultQueue;
+    mutex workerMutex;
+    int runningWorkers;
+    exception_ptr workerException;
+    SAMBlockReader samReader; // the mapped blocks are parsed after reading.
+
+    /**
+     * stop all stages. it is called when the input ends or any stage fails.
+     */
+    void closeAll() {
+        freeBatches.close();
+        parseQueue.close();
+        resultQueue.close();
+    }
+
+    void readSAM(FILE *input) {
+        try {
+            samReader.open(input);
+            long long int nextId = 0;
+            AlignmentBatch *batch;
+            while (freeBatches.popFront(batch)) {
+                StageTimer timer(stageInput);
+                if (!samReader.read(batch->text, batch->textData,
+                                    batch->textLength)) {
+                    break;
+                }
+                batch->id = nextId++;
+                parseQueue.push(batch);
+            }
+        } catch (...) {
+            lock_guard<mutex> lock(workerMutex);
+            if (!workerException) {
+                workerException = current_exception();
+            }
+            closeAll();
+        }
+        parseQueue.close();
+    }
+
+    void readBAM() {
+        try {
+            long long int nextId = 0;
+            bool eof = false;
+            AlignmentBatch *batch;
+            char buff[4];
+            while (!eof && freeBatches.popFront(batch)) {
+                StageTimer timer(stageInput);
+                batch->id = nextId++;
+                batch->nLines = 0;
+                batch->bamLength = 0;
+                while (batch->nLines < batchLineCount) {
+                    if (!bamReader->read(buff, 4)) {
+                        eof = true;
+                        break;
+                    }
+                    int length = readInt32(buff);
+                    if (length < 32) {
+                        cerr << "The alignment file has a broken BAM record."
+                             << endl;
+                        throw 1;
+                    }
+                    if ((size_t)batch->bamLength + 4 + length > batch->bamData.size()) {
+                        batch->bamData.resize((batch->bamLength + 4 + length) * 2);
+                    }
+                    char *record = batch->bamData.data() + batch->bamLength;
+                    memcpy(record, buff, 4);
+                    if (!bamReader->read(record + 4, length)) {
+                        cerr << "The alignment file is truncated." << endl;
+                        throw 1;
+                    }
+                    batch->bamLength += 4 + length;
+                    batch->nLines++;
+                }
+                parseQueue.push(batch);
+            }
+        } catch (...) {
+            lock_guard<mutex> lock(workerMutex);
+            if (!workerException) {
+                workerException = current_exception();
+            }
+            closeAll();
+        }
+        parseQueue.close();
+    }
+
+    /**
+     * count the record just parsed into increments to batch->reads. return
+     * true if the read is counted.
+     */
+    bool countRecord(AlignmentBatch *batch, Alignment &alignment,
+                     ParsedRecord &record) {
+        record.counted = false;
+        record.nConverted = 0;
+        if (runStats == NULL) {
+            return false;
+        }
+        for (int i = record.incBegin; i < record.incEnd; i++) {
+            record.nConverted += batch->increments[i].converted;
+        }
+        record.counted = batch->reads.countRecord<Policy>(
+            alignment, true, record.incEnd - record.incBegin,
+            record.nConverted);
+        return record.counted;
+    }
+
+    /**
+     * decode every BAM record in batch and collect its counting events.
+     */
+    void parseBAMBatch(AlignmentBatch *batch, Alignment &alignment) {
+        batch->nRecords = 0;
+        batch->increments.clear();
+        const char *record = batch->bamData.data();
+        for (int i = 0; i < batch->nLines; i++) {
+            int length = readInt32(record);
+            record += 4;
+            int ref = readInt32(record);
+            if (ref < 0 && runStats != NULL) {
+                batch->reads.countUnmapped();
+            }
+            if (ref >= 0) {
+                if (batch->nRecords == batch->records.size()) {
+                    batch->records.emplace_back();
+                }
+                ParsedRecord &parsed = batch->records[batch->nRecords];
+                BAMRecord::decode(record, length, alignment, header);
+                parsed.contig = alignment.contig;
+                parsed.location = alignment.location;
+                parsed.unique = alignment.unique;
+                parsed.incBegin = batch->increments.size();
+                alignment.getIncrements<Policy>(batch->increments);
+                parsed.incEnd = batch->increments.size();
+                countRecord(batch, alignment, parsed);
+                batch->nRecords++;
+            }
+            record += length;
+        }
+    }
+
+    /**
+     * parse every SAM line in batch and collect its counting events. the
+     * lines are tokenized in one pass first.
+     */
+    void parseBatch(AlignmentBatch *batch, Alignment &alignment,
+                    SAMTokenizer &tokenizer) {
+        batch->reads = ReadStats();
+        if (bamInput) {
+            parseBAMBatch(batch, alignment);
+            return;
+        }
+        batch->nRecords = 0;
+        batch->increments.clear();
+        tokenizer.tokenize(batch->textData, batch->textLength);
+        for (size_t i = 0; i < tokenizer.records.size(); i++) {
+            const SAMRecordView &view = tokenizer.records[i];
+            const char *line = batch->textData + view.begin;
+            if (view.length == 0) {
+                continue;
+            }
+            if (line[0] == '@') {
+                positions.contigs.checkHeaderLine(line, line + view.length);
+                continue;
+            }
+            if (batch->nRecords == batch->records.size()) {
+                batch->records.emplace_back();
+            }
+            ParsedRecord &record = batch->records[batch->nRecords];
+            // if the SAM line is unmapped, get the next SAM line.
+            if (!alignment.parse<Policy>(
+                    line, tokenizer.fieldEnds.data() + view.firstField,
+                    view.nFields)) {
+                if (runStats != NULL) {
+                    batch->reads.countUnmapped();
+                }
+                continue;
+            }
+            record.contig = alignment.contig;
+            record.location = alignment.location;
+            record.unique = alignment.unique;
+            record.incBegin = batch->increments.size();
+            alignment.getIncrements<Policy>(batch->increments);
+            record.incEnd = batch->increments.size();
+            countRecord(batch, alignment, record);
+            batch->nRecords++;
+        }
+    }
+
+    void parseAlignments() {
+        Alignment alignment;
+        alignment.contigCache.dictionary = &positions.contigs;
+        SAMTokenizer tokenizer;
+        AlignmentBatch *batch;
+        try {
+            while (parseQueue.popFront(batch)) {
+                StageTimer timer(stageParse);
+                parseBatch(batch, alignment, tokenizer);
+                resultQueue.push(batch);
+            }
+        } catch (...) {
+            lock_guard<mutex> lock(workerMutex);
+            if (!workerException) {
+                workerException = current_exception();
+            }
+            closeAll();
+        }
+        lock_guard<mutex> lock(workerMutex);
+        if (--runningWorkers == 0) {
+            resultQueue.close();
+        }
+    }
+
+    void applyBatch(AlignmentBatch *batch) {
+        StageTimer timer(stageParse);
+        for (size_t i = 0; i < batch->nRecords; i++) {
+            ParsedRecord &record = batch->records[i];
+            positions.moveTo(record.contig, record.location);
+            positions.appendIncrements(
+                record.location, record.unique,
+                batch->increments.data() + record.incBegin,
+                record.incEnd - record.incBegin);
+            if (record.counted) {
+                runStats->reads.countContig(positions.curChromosomeId,
+                                            record.incEnd - record.incBegin,
+                                            record.nConverted);
+            }
+        }
+        if (runStats != NULL) {
+            runStats->reads.addRecords(batch->reads);
+            runStats->reportProgress(positions.chromosome);
+        }
+    }
+
+    /**
+     * apply the parsed batches in the order of their id.
+     */
+    void aggregate() {
+        map<long long int, AlignmentBatch *> pending;
+        long long int nextId = 0;
+        AlignmentBatch *batch;
+        while (resultQueue.popFront(batch)) {
+            pending[batch->id] = batch;
+            map<long long int, AlignmentBatch *>::iterator it;
+            while ((it = pending.find(nextId)) != pending.end()) {
+                applyBatch(it->second);
+                freeBatches.push(it->second);
+                pending.erase(it);
+                nextId++;
+            }
+        }
+    }
+
+  public:
+    ParsePipeline(Positions<Policy> &inputPositions, int inputNThreads)
+        : positions(inputPositions), nThreads(inputNThreads), bamInput(false),
+          batches(inputNThreads * 4), runningWorkers(0) {}
+
+    /**
+     * count all alignments in input, a SAM or BAM stream. BGZF blocks of BAM
+     * input are inflated on nThreads more threads. the final output of the
+     * last chromosome is left to the caller.
+     */
+    void run(FILE *input) {
+        bamInput = isBGZF(input);
+        if (bamInput) {
+            bamReader.reset(new ParallelBGZFReader(nThreads));
+            bamReader->open(input);
+            header.load(*bamReader);
+            header.setContigs(positions.contigs);
+        }
+        for (size_t i = 0; i < batches.size(); i++) {
+            freeBatches.push(&batches[i]);
+        }
+        runningWorkers = nThreads;
+        vector<thread> threads;
+        if (bamInput) {
+            threads.emplace_back(&ParsePipeline::readBAM, this);
+        } else {
+            threads.emplace_back(&ParsePipeline::readSAM, this, input);
+        }
+        for (int i = 0; i < nThreads; i++) {
+            threads.emplace_back(&ParsePipeline::parseAlignments, this);
+        }
+
+        try {
+            aggregate();
+        } catch (...) {
+            closeAll();
+            if (bamReader) {
+                bamReader->close();
+            }
+            for (size_t i = 0; i < threads.size(); i++) {
+                threads[i].join();
+            }
+            throw;
+        }
+        closeAll();
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        if (bamReader) {
+            bamReader->close();
+        }
+        if (workerException) {
+            rethrow_exception(workerException);
+        }
+    }
+};
+
+/**
+ * one piece of work in contig parallel mode: count the alignments of BAM
+ * reference ref which start in [begin, end) (0-based), and output the
+ * positions in the same range.
+ */
+class ContigTask {
+  public:
+    int ref;
+    long long int begin;
+    long long int end;
+    uint64_t size; // estimated compressed size. larger task is run first.
+    vector<string> outputFileNames;           // of each table.
+    vector<vector<ColumnarChunkInfo>> chunks; // of each table, in binary mode.
+    vector<long long int> rows;               // of each table.
+    ReadStats reads; // the alignments start in the task, if runStats is set.
+    bool done = false;
+
+    /**
+     * the name of the task in the checkpoint.
+     */
+    string key() const { return to_string(ref) + "-" + to_string(begin); }
+};
+
+/**
+ * count a coordinate-sorted and indexed BAM file by contig on nThreads
+ * worker threads. each worker has its own Positions and reference file, and
+ * writes each task to a temporary file. the calling thread writes the tasks
+ * to the output in the chromosome order of the reference file. with a
+ * checkpoint, the task files are kept in its directory, and the tasks
+ * finished by an earlier run are not counted again.
+ */
+template <typename Policy> class ContigPipeline {
+  private:
+    Positions<Policy> &positions;
+    string bamFileName;
+    int nThreads;
+    Checkpoint *checkpoint;
+    BAMHeader header;
+    BAMIndex index;
+    vector<ContigTask> tasks; // in output order.
+    vector<int> schedule;     // task index, larger first.
+    size_t nextScheduled;
+    mutex taskMutex;
+    condition_variable taskDone;
+    bool failed;
+    exception_ptr workerException;
+
+    /**
+     * make the tasks in the order of chromosomes in reference file. the
+     * contigs longer than contigRangeSize are split.
+     */
+    void makeTasks() {
+        const vector<ChromosomeFilePosition> &pos = positions.chromosomePos.pos;
+        vector<int> refOfContig(pos.size(), -1);
+        for (size_t ref = 0; ref < header.names.size(); ref++) {
+            if (index.hasAlignments(ref)) {
+                // throw if the reference file does not have this chromosome.
+                refOfContig[header.getContig(ref)] = ref;
+            }
+        }
+        vector<int> order(pos.size()); // the contigs in reference file.
+        for (size_t i = 0; i < pos.size(); i++) {
+            order[pos[i].id] = i;
+        }
+
+        for (size_t i = 0; i < order.size(); i++) {
+            int ref = refOfContig[order[i]];
+            if (ref < 0) {
+                continue;
+            }
+            long long int length = max(header.lengths[ref], 1LL);
+            long long int nRange = (length + contigRangeSize - 1) / contigRangeSize;
+            uint64_t size = index.getCompressedSize(ref);
+            for (long long int r = 0; r < nRange; r++) {
+                long long int begin = r * contigRangeSize;
+                if (r > 0 && (begin >> 14) >= (long long int)index.linearIndex[ref].size()) {
+                    break; // no alignment starts here.
+                }
+                ContigTask task;
+                task.ref = ref;
+                task.begin = begin;
+                task.end = r == nRange - 1 ? LLONG_MAX : begin + contigRangeSize;
+                task.size = size / nRange + 1;
+                tasks.push_back(task);
+            }
+        }
+        for (size_t i = 0; i < tasks.size(); i++) {
+            const CheckpointPart *part =
+                checkpoint != NULL ? checkpoint->findPart(tasks[i].key()) : NULL;
+            if (part == NULL) {
+                schedule.push_back(i);
+                continue;
+            }
+            for (size_t t = 0; t < positions.outs.size(); t++) {
+                tasks[i].outputFileNames.push_back(
+                    checkpoint->partFileName(part->key, t));
+            }
+            tasks[i].chunks = part->chunks;
+            tasks[i].rows = part->rows;
+            tasks[i].done = true;
+        }
+        stable_sort(schedule.begin(), schedule.end(), [this](int a, int b) {
+            return tasks[a].size > tasks[b].size;
+        });
+    }
+
+    void runTask(ContigTask &task, Positions<Policy> &workerPositions,
+                 BGZFReader &reader, BAMRecord &record, Alignment &alignment) {
+        int contig = header.getContig(task.ref);
+        int nTables = positions.outs.size();
+        task.outputFileNames.resize(nTables);
+        task.chunks.resize(nTables);
+        task.rows.resize(nTables);
+        vector<int> fds(nTables);
+        vector<OutputWriter> outputs(nTables);
+        for (int t = 0; t < nTables; t++) {
+            if (checkpoint != NULL) {
+                task.outputFileNames[t] = checkpoint->partFileName(task.key(), t);
+                fds[t] = checkpoint->createPartFile(task.key(), t);
+            } else {
+                fds[t] = makeTempFile(task.outputFileNames[t]);
+            }
+            outputs[t].open(fds[t], false, positions.outs[t]->isBinary(), false);
+            workerPositions.outs[t] = &outputs[t];
+        }
+        workerPositions.outputBegin = task.begin + 1;
+        workerPositions.outputEnd =
+            task.end == LLONG_MAX ? LLONG_MAX : task.end + 1;
+
+        // the alignments start before windowStart cannot reach task.begin.
+        long long int windowStart =
+            max(0LL, task.begin - maxCoveredLength) / loadingBlockSize *
+            loadingBlockSize;
+        reader.seek(index.getOffset(task.ref, windowStart));
+        bool started = false;
+        StageTimer timer(stageParse);
+        while (true) {
+            {
+                StageTimer inputTimer(stageInput);
+                if (!record.read(reader)) {
+                    break;
+                }
+            }
+            if (record.refID() != task.ref) {
+                break;
+            }
+            long long int samPos = record.location();
+            if (samPos - 1 >= task.end) {
+                break;
+            }
+            if (samPos - 1 < windowStart) {
+                continue;
+            }
+            if (!started) {
+                workerPositions.startChromosome(contig, windowStart);
+                started = true;
+            }
+            workerPositions.moveTo(contig, samPos);
+            record.toAlignment(alignment, header);
+            // the alignments before task.begin are counted by another task.
+            workerPositions.readStats =
+                runStats != NULL && samPos - 1 >= task.begin ? &task.reads
+                                                             : NULL;
+            workerPositions.appendPositions(alignment);
+        }
+        workerPositions.readStats = NULL;
+        workerPositions.startOutput(true);
+        workerPositions.outputBegin = 0;
+        workerPositions.outputEnd = LLONG_MAX;
+        for (int t = 0; t < nTables; t++) {
+            workerPositions.outs[t] = NULL;
+            outputs[t].close();
+            task.chunks[t] = outputs[t].getChunks();
+            task.rows[t] = outputs[t].rows;
+            if (checkpoint != NULL) {
+                Checkpoint::syncFile(fds[t], task.outputFileNames[t]);
+            } else if (close(fds[t]) != 0) {
+                cerr << "Cannot write temporary file: "
+                     << task.outputFileNames[t] << endl;
+                throw 1;
+            }
+        }
+        if (checkpoint != NULL) {
+            CheckpointPart part;
+            part.key = task.key();
+            part.chromosome = workerPositions.chromosomePos.getChromesomeString(contig);
+            part.rows = task.rows;
+            part.chunks = task.chunks;
+            checkpoint->commit(part);
+        }
+    }
+
+    void runWorker() {
+        try {
+            unique_ptr<Positions<Policy>> workerPositions(
+                new Positions<Policy>(positions.refFile, positions.chromosomePos,
+                              positions.tableModes));
+            BGZFReader reader;
+            reader.open(bamFileName);
+            BAMRecord record;
+            Alignment alignment;
+            while (true) {
+                int taskIndex;
+                {
+                    lock_guard<mutex> lock(taskMutex);
+                    if (failed || nextScheduled == schedule.size()) {
+                        break;
+                    }
+                    taskIndex = schedule[nextScheduled++];
+                }
+                runTask(tasks[taskIndex], *workerPositions, reader, record,
+                        alignment);
+                {
+                    lock_guard<mutex> lock(taskMutex);
+                    tasks[taskIndex].done = true;
+                }
+                taskDone.notify_all();
+            }
+        } catch (...) {
+            {
+                lock_guard<mutex> lock(taskMutex);
+                failed = true;
+                if (!workerException) {
+                    workerException = current_exception();
+                }
+            }
+            taskDone.notify_all();
+        }
+    }
+
+    /**
+     * copy the output of task to the output, then delete its temporary file.
+     * the files of the checkpoint are kept until the run is finished.
+     */
+    void writeTask(ContigTask &task) {
+        StageTimer timer(stageOutput);
+        for (size_t t = 0; t < task.outputFileNames.size(); t++) {
+            positions.outs[t]->writeFile(task.outputFileNames[t],
+                                         task.chunks[t]);
+            positions.outs[t]->rows += task.rows[t];
+            if (checkpoint == NULL) {
+                remove(task.outputFileNames[t].c_str());
+            }
+        }
+        if (runStats != NULL) {
+            runStats->reads.add(task.reads);
+            runStats->reportProgress(header.names[task.ref]);
+        }
+    }
+
+  public:
+    ContigPipeline(Positions<Policy> &inputPositions, string inputBamFileName,
+                   int inputNThreads, Checkpoint *inputCheckpoint = NULL)
+        : positions(inputPositions), bamFileName(inputBamFileName), nThreads(inputNThreads),
+          checkpoint(inputCheckpoint), nextScheduled(0), failed(false) {}
+
+    void run() {
+        string indexFileName;
+        if (!BAMIndex::findIndexFile(bamFileName, indexFileName)) {
+            cerr << "Cannot find the BAM index (.bai) of " << bamFileName
+                 << ". Please index the sorted BAM file." << endl;
+            throw 1;
+        }
+        BGZFReader reader;
+        reader.open(bamFileName);
+        header.load(reader);
+        header.setContigs(positions.contigs);
+        reader.close();
+        index.load(indexFileName);
+        if (index.firstOffset.size() != header.names.size()) {
+            cerr << "The BAM index does not match " << bamFileName << endl;
+            throw 1;
+        }
+        makeTasks();
+
+        vector<thread> threads;
+        for (int i = 0; i < nThreads; i++) {
+            threads.emplace_back(&ContigPipeline::runWorker, this);
+        }
+        for (size_t i = 0; i < tasks.size(); i++) {
+            unique_lock<mutex> lock(taskMutex);
+            taskDone.wait(lock, [this, i] { return failed || tasks[i].done; });
+            if (failed) {
+                break;
+            }
+            lock.unlock();
+            writeTask(tasks[i]);
+        }
+        for (size_t i = 0; i < threads.size(); i++) {
+            threads[i].join();
+        }
+        if (failed) {
+            for (size_t i = 0; i < tasks.size(); i++) {
+                if (checkpoint != NULL && tasks[i].done) {
+                    continue; // committed, for the next run.
+                }
+                for (size_t t = 0; t < tasks[i].outputFileNames.size(); t++) {
+                    if (!tasks[i].outputFileNames[t].empty()) {
+                        remove(tasks[i].outputFileNames[t].c_str());
+                    }
+                }
+            }
+            rethrow_exception(workerException);
+        }
+    }
+};
+
+#endif // PIPELINE_3N_TABLE_H
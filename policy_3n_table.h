@@ -0,0 +1,109 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POLICY_3N_TABLE_H
+#define POLICY_3N_TABLE_H
+
+extern char baseChangeFrom; // the base change of --base-change, which is
+extern char baseChangeTo;   // not one of the specialized conversions.
+
+/**
+ * the complement of base, on the - strand.
+ */
+constexpr char complementBase(char base) {
+    return base == 'A' ? 'T'
+           : base == 'C' ? 'G'
+           : base == 'G' ? 'C'
+           : base == 'T' ? 'A'
+           : base;
+}
+
+/**
+ * the conversion From->To known at compile time. on the - strand, it is the
+ * change of the complements.
+ */
+template <char From, char To> class Conversion {
+  public:
+    static inline char from() { return From; }
+    static inline char to() { return To; }
+    static inline char fromComplement() { return complementBase(From); }
+    static inline char toComplement() { return complementBase(To); }
+};
+
+/**
+ * the conversion set by --base-change at runtime, for the changes without
+ * a specialized Conversion.
+ */
+class RuntimeConversion {
+  public:
+    static inline char from() { return baseChangeFrom; }
+    static inline char to() { return baseChangeTo; }
+    static inline char fromComplement() { return complementBase(baseChangeFrom); }
+    static inline char toComplement() { return complementBase(baseChangeTo); }
+};
+
+/**
+ * the reads counted by the tables: unique, multiple mapped, or both.
+ */
+template <bool Unique, bool Multiple> class Selection {
+  public:
+    static inline bool counts(bool unique) { return unique ? Unique : Multiple; }
+};
+
+/**
+ * the conversion and the selection the counting kernels are compiled for.
+ */
+template <typename ConversionType, typename SelectionType>
+class CountingPolicy : public ConversionType, public SelectionType {};
+
+/**
+ * call f.template run<Policy>() with the CountingPolicy of the selection.
+ * C->T, G->A, A->G and T->C are specialized, the other changes use
+ * RuntimeConversion.
+ */
+template <typename SelectionType, typename F>
+int dispatchConversion(char from, char to, F &f) {
+    if (from == 'C' && to == 'T') {
+        return f.template run<CountingPolicy<Conversion<'C', 'T'>, SelectionType>>();
+    } else if (from == 'G' && to == 'A') {
+        return f.template run<CountingPolicy<Conversion<'G', 'A'>, SelectionType>>();
+    } else if (from == 'A' && to == 'G') {
+        return f.template run<CountingPolicy<Conversion<'A', 'G'>, SelectionType>>();
+    } else if (from == 'T' && to == 'C') {
+        return f.template run<CountingPolicy<Conversion<'T', 'C'>, SelectionType>>();
+    }
+    return f.template run<CountingPolicy<RuntimeConversion, SelectionType>>();
+}
+
+/**
+ * choose the counting kernels once, from the base change and the selected
+ * reads, and call f.template run<Policy>() with them.
+ */
+template <typename F>
+int dispatchPolicy(char from, char to, bool countUnique, bool countMultiple,
+                   F &f) {
+    if (countUnique && countMultiple) {
+        return dispatchConversion<Selection<true, true>>(from, to, f);
+    } else if (countUnique) {
+        return dispatchConversion<Selection<true, false>>(from, to, f);
+    }
+    return dispatchConversion<Selection<false, true>>(from, to, f);
+}
+
+#endif // POLICY_3N_TABLE_H
@@ -21,64 +21,261 @@
 #define POSITION_3N_TABLE_H
 
 #include "alignment_3n_table.h"
+#include "checkpoint_3n_table.h"
+#include "output_3n_table.h"
+#include "reference_3n_table.h"
+#include "regions_3n_table.h"
+#include "simd_3n_table.h"
+#include "stats_3n_table.h"
+#include "unsorted_3n_table.h"
 #include <cassert>
+#include <climits>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 // #include <map>
 
 using namespace std;
 
+const int windowCapacity = 32768; // initial capacity, power of 2, larger
+                                  // than 2 loadingBlockSize.
+const int siteWindowCapacity = windowCapacity / 2; // initial capacity of the
+                                                   // sites, power of 2.
+
 /**
- * basic class to store reference position information
+ * the high counts of a saturated counter of PositionWindow, multiples of
+ * 65536.
  */
-class Position {
+class OverflowCount {
   public:
-    short chromosomeId;
-    long long int location; // 1-based position
-    char strand;            // +(REF) or -(REF-RC)
-    unsigned short convertedCount = 0;
-    unsigned short unconvertedCount = 0;
-    bool empty = true;
+    unsigned long long int converted = 0;
+    unsigned long long int unconverted = 0;
+};
 
-    void initialize() {
-        // chromosome.clear();
-        chromosomeId = -1;
-        location = -1;
-        strand = '?';
-        convertedCount = 0;
-        unconvertedCount = 0;
-        empty = true;
+/**
+ * the reference positions in a ring buffer, stored as arrays. the strand
+ * bitmaps mark the convertible (+) and the complement (-) bases, in upper
+ * or lower case, these are the sites. only the sites have counters, they are
+ * stored in a second ring in the order of positions: the sites of word w
+ * start at siteStart[w], the slot of a site is found by the rank (popcount)
+ * of the sites before it in the word. each table has a covered bitmap, which
+ * marks the positions with mapped bases, and its counters. the chromosome and
+ * location of each position come from the window origin in Positions. the
+ * capacities are powers of 2, they are changed by Positions with the span of
+ * reads and the density of sites. the counters are 16 bits, when one wraps
+ * around, 65536 is added to its high count in overflow, so the counts are
+ * exact and the side table is only used at very deep sites.
+ */
+class PositionWindow {
+  public:
+    int capacity;
+    int mask;
+    int siteCapacity;
+    int siteMask;
+    int nTables;
+    int siteEnd = 0; // the slot after the last site.
+    int nSites = 0;  // the sites in the window.
+    vector<uint64_t> plusStrand;
+    vector<uint64_t> minusStrand;
+    vector<int> siteStart;                   // [capacity / 64]
+    vector<uint64_t> covered;                // [table][capacity / 64]
+    vector<unsigned short> convertedCount;   // [table][siteCapacity]
+    vector<unsigned short> unconvertedCount; // [table][siteCapacity]
+    unordered_map<int, OverflowCount> overflow; // of counter index.
+
+    PositionWindow(int inputCapacity = windowCapacity,
+                   int inputSiteCapacity = siteWindowCapacity,
+                   int inputNTables = 1) {
+        capacity = inputCapacity;
+        mask = capacity - 1;
+        siteCapacity = inputSiteCapacity;
+        siteMask = siteCapacity - 1;
+        nTables = inputNTables;
+        plusStrand.resize(capacity / 64);
+        minusStrand.resize(capacity / 64);
+        siteStart.resize(capacity / 64);
+        covered.resize(nTables * capacity / 64);
+        convertedCount.resize(nTables * siteCapacity);
+        unconvertedCount.resize(nTables * siteCapacity);
     }
 
-    Position() { initialize(); };
+    /**
+     * change the capacities to newCapacity and newSiteCapacity. the length
+     * positions from start (and their sites) are moved to the beginning.
+     */
+    void resize(int newCapacity, int newSiteCapacity, int start, int length) {
+        PositionWindow window(newCapacity, newSiteCapacity, nTables);
+        for (int k = 0; k < length; k++) {
+            int i = (start + k) & mask;
+            uint64_t bit = 1ULL << (k & 63);
+            if ((k & 63) == 0) {
+                window.siteStart[k >> 6] = window.siteEnd;
+            }
+            if ((plusStrand[i >> 6] >> (i & 63)) & 1) {
+                window.plusStrand[k >> 6] |= bit;
+            }
+            if ((minusStrand[i >> 6] >> (i & 63)) & 1) {
+                window.minusStrand[k >> 6] |= bit;
+            }
+            for (int t = 0; t < nTables; t++) {
+                if ((covered[t * capacity / 64 + (i >> 6)] >> (i & 63)) & 1) {
+                    window.covered[t * newCapacity / 64 + (k >> 6)] |= bit;
+                }
+            }
+            if (!isConvertible(i)) {
+                continue;
+            }
+            int site = getSite(i);
+            for (int t = 0; t < nTables; t++) {
+                int counter = t * siteCapacity + site;
+                int newCounter = t * newSiteCapacity + window.siteEnd;
+                window.convertedCount[newCounter] = convertedCount[counter];
+                window.unconvertedCount[newCounter] = unconvertedCount[counter];
+                if (!overflow.empty()) {
+                    unordered_map<int, OverflowCount>::iterator it =
+                        overflow.find(counter);
+                    if (it != overflow.end()) {
+                        window.overflow[newCounter] = it->second;
+                    }
+                }
+            }
+            window.siteEnd++;
+            window.nSites++;
+        }
+        window.siteEnd &= window.siteMask;
+        swap(*this, window);
+    }
 
     /**
-     * return true if there is mapping information in this reference position.
+     * the convertible positions in word w.
      */
-    inline bool isEmpty() { return empty; }
+    inline uint64_t getSites(int w) { return plusStrand[w] | minusStrand[w]; }
 
     /**
-     * set the chromosome, location (position), and strand information.
+     * the slot of the counters of convertible position i.
      */
+    inline int getSite(int i) {
+        uint64_t before = getSites(i >> 6) & ((1ULL << (i & 63)) - 1);
+        return (siteStart[i >> 6] + popcount64(before)) & siteMask;
+    }
 
-    inline void set(int InChromosomeId, long long int inputLoc) {
-        chromosomeId = InChromosomeId;
-        location = inputLoc + 1;
+    /**
+     * append the positions in mask of word w, which start from bit, with
+     * their strands. their sites are appended after the last site with
+     * cleared counters. the positions in the same word are within one ring.
+     */
+    inline void appendStrands(int w, int bit, uint64_t mask, uint64_t plus,
+                              uint64_t minus) {
+        if (bit == 0) {
+            siteStart[w] = siteEnd;
+        }
+        plusStrand[w] = (plusStrand[w] & ~mask) | plus;
+        minusStrand[w] = (minusStrand[w] & ~mask) | minus;
+        for (int t = 0; t < nTables; t++) {
+            covered[t * capacity / 64 + w] &= ~mask;
+        }
+        int n = popcount64(plus | minus);
+        int first = min(n, siteCapacity - siteEnd); // before the ring wraps.
+        clearCounts(siteEnd, first);
+        clearCounts(0, n - first);
+        siteEnd = (siteEnd + n) & siteMask;
+        nSites += n;
     }
 
-    inline void set(char inputStrand) { strand = inputStrand; }
+    /**
+     * clear the counters of n sites from slot, in the same ring.
+     */
+    inline void clearCounts(int slot, int n) {
+        for (int t = 0; t < nTables; t++) {
+            memset(&convertedCount[t * siteCapacity + slot], 0,
+                   n * sizeof(unsigned short));
+            memset(&unconvertedCount[t * siteCapacity + slot], 0,
+                   n * sizeof(unsigned short));
+            for (int k = 0; k < n && !overflow.empty(); k++) {
+                overflow.erase(t * siteCapacity + slot + k);
+            }
+        }
+    }
 
     /**
-     * append the SAM information into this position.
+     * get the counts of table at site, with their overflow.
      */
-    void appendBase(PosQuality &input, Alignment &a) {
-        empty = false;
-        if (input.converted) {
-            convertedCount++;
-        } else {
-            unconvertedCount++;
+    inline void getCounts(int table, int site,
+                          unsigned long long int &converted,
+                          unsigned long long int &unconverted) {
+        int counter = table * siteCapacity + site;
+        converted = convertedCount[counter];
+        unconverted = unconvertedCount[counter];
+        if (!overflow.empty()) {
+            unordered_map<int, OverflowCount>::iterator it =
+                overflow.find(counter);
+            if (it != overflow.end()) {
+                converted += it->second.converted;
+                unconverted += it->second.unconverted;
+            }
+        }
+    }
+
+    /**
+     * the number of sites in the length positions from start.
+     */
+    int countSites(int start, int length) {
+        int n = 0;
+        for (int offset = 0; offset < length;) {
+            int i = (start + offset) & mask;
+            int bit = i & 63;
+            int m = min(64 - bit, length - offset);
+            uint64_t sites = getSites(i >> 6) >> bit;
+            if (m < 64) {
+                sites &= (1ULL << m) - 1;
+            }
+            n += popcount64(sites);
+            offset += m;
+        }
+        return n;
+    }
+
+    /**
+     * return true if position i is + or - strand.
+     */
+    inline bool isConvertible(int i) {
+        return (getSites(i >> 6) >> (i & 63)) & 1;
+    }
+
+    inline char getStrand(int i) {
+        if ((plusStrand[i >> 6] >> (i & 63)) & 1) {
+            return '+';
+        }
+        return ((minusStrand[i >> 6] >> (i & 63)) & 1) ? '-' : '?';
+    }
+
+    /**
+     * the positions of table with mapped bases in word w.
+     */
+    inline uint64_t getCovered(int table, int w) {
+        return covered[table * capacity / 64 + w];
+    }
+
+    inline bool isCovered(int table, int i) {
+        return (getCovered(table, i >> 6) >> (i & 63)) & 1;
+    }
+
+    /**
+     * append the SAM information into convertible position i of table.
+     */
+    inline void appendBase(int table, int i, bool converted) {
+        covered[table * capacity / 64 + (i >> 6)] |= 1ULL << (i & 63);
+        int counter = table * siteCapacity + getSite(i);
+        if (converted) {
+            if (++convertedCount[counter] == 0) {
+                overflow[counter].converted += 65536;
+            }
+        } else if (++unconvertedCount[counter] == 0) {
+            overflow[counter].unconverted += 65536;
         }
     }
 };
@@ -87,232 +284,574 @@ class Position {
 // #define MP make_pair
 // map<int, bool> chrPosOutput;
 /**
- * store all reference position in this class.
+ * store all reference position in this class. the conversion and the
+ * selected reads are fixed by Policy (CountingPolicy).
  */
-class Positions {
+template <typename Policy> class Positions {
   public:
-    Position refPositions[loadingBlockSize*2+123];
+    PositionWindow refPositions;
 
     string chromosome; // current reference chromosome name.'
-    int curChromosomeId;
+    int curChromosomeId; // the contig id of chromosome, -1 before the first.
     int refPosStartPtr, refPosEndPtr;
+    long long int windowStart; // the location (1-based) at refPosStartPtr.
     long long int
         location; // current location (position) in reference chromosome.
     long long int refCoveredPosition; // this is the last position in reference
                                       // chromosome we loaded in refPositions.
-    ifstream refFile;
+    long long int reloadPos; // the position in reference that we need to reload.
+    long long int lastPos;   // the position on last SAM line. compare lastPos
+                             // with samPos to make sure the SAM is sorted.
+    ReferenceFile refFile;
     ChromosomeFilePositions
-        chromosomePos; // store the chromosome name and it's streamPos. To
+        chromosomePos; // store the chromosome name and it's position. To
                        // quickly find new chromosome in file.
+    ContigDictionary contigs; // the contig ids of chromosomePos.
+    vector<char> tableModes;     // the reads counted in each table, u or m.
+    int nSamples = 1;            // the inputs counted in each table.
+    int sample = 0;              // the input of the appended alignments.
+    bool longSamples = false;    // output one row of each sample,
+    vector<string> sampleNames;  // with its name.
+    vector<unsigned long long int> sampleCounts; // the row of outputSamples.
+    vector<vector<int>> uniqueTables;   // the tables of each sample count
+    vector<vector<int>> multipleTables; // unique or multiple mapped reads.
+    vector<OutputWriter *> outs; // the output of each table.
+    vector<UnsortedCounter *> unsorted; // if set, count the unsorted input.
+    long long int outputBegin = 0;       // only output the location in
+    long long int outputEnd = LLONG_MAX; // [outputBegin, outputEnd).
+    Checkpoint *checkpoint = NULL; // if set, each contig is output to a part.
+    RegionSet *regions = NULL; // if set, only count and output the regions.
 
     Alignment tmpAlignment;
+    ClassifyFunction classify = getClassifyFunction(); // the strand kernel.
+    ReadStats *readStats = NULL; // if set, count the appended records.
 
-    Positions(string inputRefFileName) {
-        refFile.open(inputRefFileName, ios_base::in);
-        LoadChromosomeNamesPos();
-        refPosStartPtr = refPosEndPtr = location = refCoveredPosition = 0;
-        chromosome = "";
+    Positions(string inputRefFileName, const vector<char> &inputTableModes) {
+        refFile.open(inputRefFileName, chromosomePos);
+        chromosomePos.sort();
+        initialize(inputTableModes);
+    }
+
+    /**
+     * open the reference opened by another Positions, with its chromosome
+     * positions, so the index is not loaded again.
+     */
+    Positions(const ReferenceFile &inputRefFile,
+              const ChromosomeFilePositions &inputChromosomePos,
+              const vector<char> &inputTableModes) {
+        refFile.open(inputRefFile);
+        chromosomePos = inputChromosomePos;
+        initialize(inputTableModes);
     }
 
     ~Positions() {
         refFile.close();
     }
 
-    inline int Mod(int x) { return x >= 2*loadingBlockSize+67 ? x - (2*loadingBlockSize+67) : x; }
+    /**
+     * the state before the first alignment, same for both constructors.
+     */
+    void initialize(const vector<char> &inputTableModes) {
+        contigs.open(chromosomePos);
+        tmpAlignment.contigCache.dictionary = &contigs;
+        setTables(inputTableModes);
+        refPosStartPtr = refPosEndPtr = location = refCoveredPosition = 0;
+        windowStart = 1;
+        reloadPos = lastPos = 0;
+        chromosome = "";
+        curChromosomeId = -1;
+    }
 
-    void startOutput(bool final_ = false) {
-        int start_id = refPosStartPtr;
-        int end_id = final_ ? refPosEndPtr : Mod(refPosStartPtr + loadingBlockSize);
-        for (int i = start_id; i != end_id; i = Mod(i+1)) {
-            Position &pos = refPositions[i];
-            if (!(pos.isEmpty() || pos.strand == '?')) {
-                // if (chrPosOutput.find(refPositions[i].location) != chrPosOutput.end()) {
-                //     cerr << "Error: position " << refPositions[i].location << " in chromosome " << refPositions[i].chromosomeId << " is already output." << endl;
-                //     exit(-1);
-                // }
-                // chrPosOutput[refPositions[i].location] = true;
-                
-                const string &chr =
-                    chromosomePos.getChromesomeString(pos.chromosomeId);
-                cout << chr << '\t' << pos.location << '\t'
-                        << pos.strand << '\t' << pos.convertedCount << '\t'
-                        << pos.unconvertedCount << '\n';
+    /**
+     * count the tables of modes, u for unique reads and m for multiple mapped
+     * reads, for inputSamples inputs. each table has the counters of every
+     * sample in the window: the counters of sample s in table t are window
+     * table s * modes.size() + t. all tables share the reference window.
+     */
+    void setTables(const vector<char> &modes, int inputSamples = 1) {
+        tableModes = modes;
+        nSamples = inputSamples;
+        uniqueTables.assign(nSamples, vector<int>());
+        multipleTables.assign(nSamples, vector<int>());
+        for (int s = 0; s < nSamples; s++) {
+            for (size_t t = 0; t < modes.size(); t++) {
+                (modes[t] == 'u' ? uniqueTables : multipleTables)[s].push_back(
+                    s * modes.size() + t);
             }
         }
-        refPosStartPtr = end_id;
+        outs.assign(modes.size(), NULL);
+        refPositions = PositionWindow(windowCapacity, siteWindowCapacity,
+                                      nSamples * modes.size());
     }
 
     /**
-     * given the target Position output the corresponding position index in
-     * refPositions.
+     * the window tables of sample count the read.
      */
-    int getIndex(long long int &targetPos) {
-        int firstPos = refPositions[refPosStartPtr].location;
-        int ret = Mod(targetPos - firstPos + refPosStartPtr);
-        return ret;
+    inline const vector<int> &getTables(bool unique) {
+        return unique ? uniqueTables[sample] : multipleTables[sample];
     }
 
     /**
-     * given reference line (start with '>'), extract the chromosome
-     * information. this is important when there is space in chromosome name.
-     * the SAM information only contain the first word.
+     * the start of loadingBlockSize block which has the 1-based samPos.
      */
-    string getChrName(string &inputLine) {
-        string name;
-        for (int i = 1; i < inputLine.size(); i++) {
-            char c = inputLine[i];
-            if (isspace(c)) {
-                break;
-            }
-            name += c;
+    static long long int blockStart(long long int samPos) {
+        return max(samPos - 1, 0LL) / loadingBlockSize * loadingBlockSize;
+    }
+
+    inline int Mod(int x) { return x & refPositions.mask; }
+
+    /**
+     * the number of positions loaded in refPositions.
+     */
+    inline int windowLength() { return Mod(refPosEndPtr - refPosStartPtr); }
+
+    void startOutput(bool final_ = false) {
+        StageTimer timer(stageOutput);
+        int length = windowLength();
+        if (!final_) {
+            length = min(length, (int)loadingBlockSize);
+        }
+        for (size_t t = 0; t < outs.size() && length > 0; t++) {
+            outputTable(t, length);
         }
+        refPositions.nSites -= refPositions.countSites(refPosStartPtr, length);
+        refPosStartPtr = Mod(refPosStartPtr + length);
+        windowStart += length;
+    }
 
-        return name;
+    /**
+     * output the first length positions of table. only the sites are read, in
+     * the order of their slots.
+     */
+    void outputTable(int table, int length) {
+        OutputWriter *out = outs[table];
+        out->setChromosome(curChromosomeId,
+                           chromosomePos.getChromesomeString(curChromosomeId));
+        for (int offset = 0; offset < length;) {
+            int i = Mod(refPosStartPtr + offset);
+            int bit = i & 63;
+            int n = min(64 - bit, length - offset);
+            uint64_t sites = refPositions.getSites(i >> 6) >> bit;
+            uint64_t covered = 0;
+            for (int s = 0; s < nSamples; s++) {
+                covered |= refPositions.getCovered(s * tableModes.size() + table,
+                                                   i >> 6);
+            }
+            covered >>= bit;
+            if (n < 64) {
+                sites &= (1ULL << n) - 1;
+            }
+            if (regions != NULL) {
+                covered &= regions->getMask(curChromosomeId,
+                                            windowStart + offset, n);
+            }
+            int site = refPositions.getSite(i);
+            for (; sites != 0; sites &= sites - 1, site++) {
+                int k = __builtin_ctzll(sites);
+                long long int posLocation = windowStart + offset + k;
+                if (!((covered >> k) & 1) || posLocation < outputBegin ||
+                    posLocation >= outputEnd) {
+                    continue;
+                }
+                site &= refPositions.siteMask;
+                if (nSamples > 1) {
+                    outputSamples(table, i + k, site, posLocation);
+                    continue;
+                }
+                unsigned long long int converted, unconverted;
+                refPositions.getCounts(table, site, converted, unconverted);
+                out->writeRow(posLocation, refPositions.getStrand(i + k),
+                              converted, unconverted);
+            }
+            offset += n;
+        }
     }
 
     /**
-     * Scan the reference file. Record each chromosome and its position in file.
+     * output the counters of every sample of table at position i (with the
+     * counters at site), as one row with the columns of each sample, or with
+     * longSamples, one row of each sample with mapped bases.
      */
-    void LoadChromosomeNamesPos() {
-        string line;
-        while (refFile.good()) {
-            getline(refFile, line);
-            if (line.front() == '>') { // this line is chromosome name
-                chromosome = getChrName(line);
-                streampos currentPos = refFile.tellg();
-                chromosomePos.append(chromosome, currentPos);
+    void outputSamples(int table, int i, int site, long long int location) {
+        OutputWriter *out = outs[table];
+        char strand = refPositions.getStrand(i);
+        sampleCounts.resize(2 * nSamples);
+        for (int s = 0; s < nSamples; s++) {
+            int sampleTable = s * tableModes.size() + table;
+            unsigned long long int converted, unconverted;
+            refPositions.getCounts(sampleTable, site, converted, unconverted);
+            if (!longSamples) {
+                sampleCounts[2 * s] = converted;
+                sampleCounts[2 * s + 1] = unconverted;
+            } else if (refPositions.isCovered(sampleTable, i)) {
+                out->writeSampleRow(location, strand, sampleNames[s],
+                                    converted, unconverted);
             }
         }
-        chromosomePos.sort();
-        chromosome.clear();
+        if (!longSamples) {
+            out->writeSamplesRow(location, strand, sampleCounts.data(),
+                                 nSamples);
+        }
     }
 
     /**
-     * get a fasta line (not header), append the bases to positions.
+     * change the capacities of refPositions to newCapacity and
+     * newSiteCapacity, the positions are moved to the beginning.
      */
-    inline void appendRefPosition(string &line, int &cur) {
+    void resizeWindow(int newCapacity, int newSiteCapacity) {
+        int length = windowLength();
+        refPositions.resize(newCapacity, newSiteCapacity, refPosStartPtr,
+                            length);
+        refPosStartPtr = 0;
+        refPosEndPtr = length;
+    }
 
-        // check the base one by one
-        int len = line.size();
+    /**
+     * grow refPositions to hold length positions. one word is kept free, so
+     * the last word never wraps into the first one, and the sites of a word
+     * stay contiguous.
+     */
+    inline void reserveWindow(int length) {
+        if (length + 64 < refPositions.capacity) {
+            return;
+        }
+        int capacity = refPositions.capacity;
+        while (capacity <= length + 64) {
+            capacity *= 2;
+        }
+        resizeWindow(capacity, refPositions.siteCapacity);
+    }
 
-#pragma unroll(60)
-        for (int i = 0; i < len; i++) {
-            refPositions[Mod(cur + i)].initialize();
-            refPositions[Mod(cur + i)].set(curChromosomeId, location + i);
-            char b = line[i];
-            if (b == convertFrom) {
-                refPositions[Mod(cur + i)].set('+');
-            } else if (b == convertFromComplement) {
-                refPositions[Mod(cur + i)].set('-');
+    /**
+     * grow the sites of refPositions to hold n more sites.
+     */
+    inline void reserveSites(int n) {
+        if (refPositions.nSites + n <= refPositions.siteCapacity) {
+            return;
+        }
+        int siteCapacity = refPositions.siteCapacity;
+        while (siteCapacity < refPositions.nSites + n) {
+            siteCapacity *= 2;
+        }
+        resizeWindow(refPositions.capacity, siteCapacity);
+    }
+
+    /**
+     * shrink refPositions after the positions of long reads or the sites of
+     * dense regions are output.
+     */
+    void shrinkWindow() {
+        int capacity = refPositions.capacity;
+        if (capacity > windowCapacity && windowLength() < capacity / 4) {
+            capacity = windowCapacity;
+            while (capacity <= 2 * windowLength()) {
+                capacity *= 2;
             }
         }
+        int siteCapacity = refPositions.siteCapacity;
+        if (siteCapacity > siteWindowCapacity &&
+            refPositions.nSites < siteCapacity / 4) {
+            siteCapacity = siteWindowCapacity;
+            while (siteCapacity <= 2 * refPositions.nSites) {
+                siteCapacity *= 2;
+            }
+        }
+        if (capacity != refPositions.capacity ||
+            siteCapacity != refPositions.siteCapacity) {
+            resizeWindow(capacity, siteCapacity);
+        }
+    }
+
+    /**
+     * append n reference bases to positions. the strand bitmaps are set 64
+     * positions (one word) at a time by the classify kernel, the partial words
+     * at the ends are classified from a padded copy.
+     */
+    inline void appendRefPosition(const char *bases, int len, int &cur) {
+        int done = 0;
+        while (done < len) {
+            reserveSites(min(64, len - done));
+            int i = Mod(cur);
+            int bit = i & 63;
+            int n = min(64 - bit, len - done);
+            uint64_t plus, minus;
+            if (n == 64) {
+                classify(bases + done, Policy::from(), Policy::fromComplement(),
+                         plus, minus);
+            } else {
+                char word[64] = {0};
+                memcpy(word, bases + done, n);
+                classify(word, Policy::from(), Policy::fromComplement(), plus,
+                         minus);
+                uint64_t low = (1ULL << n) - 1;
+                plus = (plus & low) << bit;
+                minus = (minus & low) << bit;
+            }
+            uint64_t mask = n == 64 ? ~0ULL : ((1ULL << n) - 1) << bit;
+            refPositions.appendStrands(i >> 6, bit, mask, plus, minus);
+            done += n;
+            cur = Mod(cur + n);
+        }
         location += len;
-        cur = Mod(cur + len);
     }
 
     /**
-     * initially load reference sequence for 2 million bp
+     * append the reference bases from location to end (0-based, exclusive).
+     * meetNext is set to 1 if the chromosome is finished.
      */
-    void loadNewChromosome(string targetChromosome, int &meetNext) {
-        // chrPosOutput.clear();
-        meetNext = 0;
-        refFile.clear();
-        // find the start position in file based on chromosome name.
-        streampos startPos =
-            chromosomePos.getChromosomePosInRefFile(targetChromosome);
-        chromosome = targetChromosome;
-        curChromosomeId = chromosomePos.findChromosome(
-            targetChromosome, 0, chromosomePos.pos.size() - 1);
-        refFile.seekg(startPos, ios::beg);
-        refCoveredPosition = 2 * loadingBlockSize;
-        refPosStartPtr = 0;
+    void loadBases(long long int end, int &meetNext) {
+        StageTimer timer(stageReference);
+        const ChromosomeFilePosition &chr = chromosomePos.pos[curChromosomeId];
+        end = min(end, chr.length);
+        while (location < end) {
+            int n;
+            const char *bases = refFile.getBases(chr, location, n);
+            n = min((long long int)n, end - location);
+            reserveWindow(windowLength() + n);
+            appendRefPosition(bases, n, refPosEndPtr);
+        }
+        meetNext = location >= chr.length;
+    }
 
-        string line;
-        location = 0;
+    /**
+     * initially load reference sequence for 2 loadingBlockSize bp from
+     * startLocation (0-based). the bases before startLocation are skipped.
+     */
+    void loadNewChromosome(int contig, int &meetNext,
+                           long long int startLocation = 0) {
+        curChromosomeId = contig;
+        chromosome = chromosomePos.getChromesomeString(contig);
+        refCoveredPosition = startLocation + 2 * loadingBlockSize;
+        refPosStartPtr = 0;
         refPosEndPtr = 0;
-        while (refFile.good()) {
-            getline(refFile, line);
-            if (line.front() == '>') { // this line is chromosome name
-                meetNext = 1;
-                break;                // meet next chromosome, return it.
-            } else {
-                if (line.empty()) {
-                    continue;
-                }
-                appendRefPosition(line, refPosEndPtr);
-                if (location >= refCoveredPosition) {
-                    break;
-                }
-            }
+        if (refPositions.capacity != windowCapacity ||
+            refPositions.siteCapacity != siteWindowCapacity) {
+            refPositions = PositionWindow(windowCapacity, siteWindowCapacity,
+                                          nSamples * tableModes.size());
         }
+        refPositions.nSites = 0;
+        location = startLocation;
+        windowStart = startLocation + 1;
+        loadBases(refCoveredPosition, meetNext);
     }
 
-    bool flag_ = false;
     /**
-     * load more Position (loadingBlockSize bp) to positions
-     * if we meet next chromosome, return false. Else, return ture.
+     * load more Position (loadingBlockSize bp) to positions, so there are 2
+     * loadingBlockSize bp after windowStart. the window may already cover more
+     * for long reads. if we meet next chromosome, meetNext is set to 1.
      */
     void loadMore(int &meetNext) {
-        meetNext = 0;
-        refCoveredPosition += loadingBlockSize;
-        string line;
-        // refPosStartPtr = Mod(refPosStartPtr + loadingBlockSize);
-        while (refFile.good()) {
-            getline(refFile, line);
-            if (line.front() == '>') { // meet next chromosome, return.
-                meetNext = 1;
-                break;
-            } else {
-                if (line.empty()) {
-                    continue;
-                }
-                appendRefPosition(line, refPosEndPtr);
-                if (location >= refCoveredPosition) {
-                    break;
-                }
-            }
+        refCoveredPosition = max(refCoveredPosition,
+                                 windowStart - 1 + 2 * loadingBlockSize);
+        loadBases(refCoveredPosition, meetNext);
+    }
+
+    /**
+     * load the reference to the block which has the 1-based target, for a read
+     * spans out of the window. return false if target is out of the
+     * chromosome.
+     */
+    bool extendWindow(long long int target) {
+        if (target > chromosomePos.pos[curChromosomeId].length) {
+            return false;
         }
+        refCoveredPosition =
+            max(refCoveredPosition, (target + loadingBlockSize - 1) /
+                                        loadingBlockSize * loadingBlockSize);
+        int meetNext;
+        loadBases(refCoveredPosition, meetNext);
+        return true;
     }
 
     /**
-     * add position information from Alignment into ref position.
+     * move the reference window to the SAM line at contig:samPos (contig id in
+     * contigs). when the chromosome changes, output everything and load the
+     * new chromosome. when samPos is larger than reloadPos, output one
+     * loadingBlockSize bp and load one more. the SAM lines must come sorted.
      */
-    void appendPositions(Alignment &newAlignment) {
-        if (!newAlignment.mapped || newAlignment.bases.empty()) {
+    void moveTo(int contig, long long int samPos) {
+        if (!unsorted.empty()) {
+            // no window, only set the chromosome.
+            if (contig != curChromosomeId) {
+                curChromosomeId = contig;
+                chromosome = chromosomePos.getChromesomeString(contig);
+            }
             return;
         }
-        long long int startPos = newAlignment.location; // 1-based position
-        // find the first reference position in pool.
-        int index = getIndex(newAlignment.location);
-
-        for (int i = 0; i < newAlignment.sequence.size(); i++) {
-            PosQuality *b = &newAlignment.bases[i];
-            if (b->remove) {
-                continue;
+        // if the contig is different than current chromosome, finish
+        // all SAM line. then load a new reference chromosome.
+        if (contig != curChromosomeId) {
+            if (checkpoint != NULL) {
+                // the contig is finished when the next one starts.
+                startOutput(true);
+                checkpoint->startPart(chromosomePos.getChromesomeString(contig),
+                                      outs);
             }
+            startChromosome(contig, blockStart(samPos));
+        } else if (samPos > reloadPos && blockStart(samPos) >= location) {
+            // no loaded position can be reached by later SAM lines, output
+            // them and skip to the block of samPos.
+            long long int samLastPos = lastPos;
+            startChromosome(contig, blockStart(samPos));
+            lastPos = samLastPos;
+        }
+        // if the samPos is larger than reloadPos, load 1 loadingBlockSize bp in
+        // from reference.
+        while (samPos > reloadPos) {
+            startOutput();
+            shrinkWindow();
+            int meetNext;
+            loadMore(meetNext);
+            reloadPos += meetNext ? inf : loadingBlockSize;
+        }
+        if (lastPos > samPos) {
+            cerr << "The input alignment file is not sorted. Please use sorted "
+                    "SAM file as alignment file, or count it with --unsorted."
+                 << endl;
+            throw 1;
+        }
+        lastPos = samPos;
+    }
+
+    /**
+     * move the reference window to the alignment at contig:samPos, which
+     * covers coveredLength bp, if it can reach a region. the window starts at
+     * the region, the bases before it are not counted. return false if the
+     * alignment is out of the regions.
+     */
+    inline bool moveToRegion(int contig, long long int samPos,
+                             long long int coveredLength) {
+        long long int target = regions->find(contig, samPos, coveredLength);
+        if (target < 0) {
+            return false;
+        }
+        moveTo(contig, target);
+        return true;
+    }
+
+    /**
+     * output everything, then start the reference window of contig at
+     * startLocation (0-based, a multiple of loadingBlockSize).
+     */
+    void startChromosome(int contig, long long int startLocation) {
+        startOutput(true);
+
+        int meetNext;
+        loadNewChromosome(contig, meetNext, startLocation);
+        reloadPos = meetNext ? inf : startLocation + loadingBlockSize;
+        lastPos = 0;
+    }
 
-            Position &pos = refPositions[Mod(index + b->refPos)];
-            if (pos.location != startPos + b->refPos) {
-                cerr << "Error: position mismatch. pos.location is " << pos.location << " which is refPositions+" << Mod(index + b->refPos) << ", but startPos is " << startPos << ", and b->refPos is " << b->refPos << endl;
-                cerr << "newAlignment.location = " << newAlignment.location <<  ", index = " << index << ", b->refPos = " << b->refPos << endl;
-                cerr << "refPositions[refPosStartPtr].location = " << refPositions[refPosStartPtr].location << ", refPosStartPtr = " << refPosStartPtr << endl;
-                cerr << "refPositions[refPosEndPtr-1].location = " << refPositions[refPosEndPtr-1].location << ", refPosEndPtr = " << refPosEndPtr << endl;
-                exit(-1);
+    /**
+     * count one base of the alignment at startPos in tables. the window is
+     * extended if the base is after it, and the base is skipped if it is out
+     * of the chromosome.
+     */
+    inline void appendBase(long long int startPos, int refPos, bool converted,
+                           const vector<int> &tables) {
+        long long int offset = startPos + refPos - windowStart;
+        if (offset >= windowLength() && !extendWindow(startPos + refPos)) {
+            return;
+        }
+        if (offset < 0) {
+            if (regions != NULL) {
+                return; // before the region of the window.
             }
-            // assert(pos.location == startPos + b->refPos);
-            // assert(0 <= b->refPos && b->refPos <= loadingBlockSize);
+            cerr << "Error: position mismatch. position " << startPos + refPos
+                 << " is before the reference window of " << chromosome
+                 << ", which starts at " << windowStart << endl;
+            throw 1;
+        }
 
-            if (pos.strand == '?') {
-                // this is for CG-only mode. read has a 'C' or 'G' but not 'CG'.
-                continue;
+        int i = Mod(refPosStartPtr + (int)offset);
+        if (!refPositions.isConvertible(i)) {
+            // this is for CG-only mode. read has a 'C' or 'G' but not 'CG'.
+            return;
+        }
+        for (size_t t = 0; t < tables.size(); t++) {
+            refPositions.appendBase(tables[t], i, converted);
+        }
+    }
+
+    /**
+     * count one base of the unsorted input in tables.
+     */
+    inline void appendUnsorted(long long int location, bool converted,
+                               const vector<int> &tables) {
+        int id = chromosomePos.pos[curChromosomeId].id;
+        for (size_t t = 0; t < tables.size(); t++) {
+            unsorted[tables[t]]->add(id, location, converted);
+        }
+    }
+
+    /**
+     * add position information from Alignment into ref position.
+     */
+    void appendPositions(Alignment &newAlignment) {
+        long long int startPos = newAlignment.location; // 1-based position
+        const vector<int> &tables = getTables(newAlignment.unique);
+        int nBases = 0;
+        int nConverted = 0;
+        if (!unsorted.empty()) {
+            newAlignment.scanBases<Policy>([&](int refPos, bool converted) {
+                appendUnsorted(startPos + refPos, converted, tables);
+                nBases++;
+                nConverted += converted;
+            });
+        } else {
+            newAlignment.scanBases<Policy>([&](int refPos, bool converted) {
+                appendBase(startPos, refPos, converted, tables);
+                nBases++;
+                nConverted += converted;
+            });
+        }
+        if (readStats != NULL &&
+            readStats->countRecord<Policy>(newAlignment, true, nBases,
+                                           nConverted)) {
+            readStats->countContig(curChromosomeId, nBases, nConverted);
+        }
+    }
+
+    /**
+     * add the counting events of one alignment at startPos into ref position.
+     */
+    void appendIncrements(long long int startPos, bool unique,
+                          const PosIncrement *increments, int n) {
+        const vector<int> &tables = getTables(unique);
+        for (int i = 0; i < n; i++) {
+            if (!unsorted.empty()) {
+                appendUnsorted(startPos + increments[i].refPos,
+                               increments[i].converted, tables);
+            } else {
+                appendBase(startPos, increments[i].refPos,
+                           increments[i].converted, tables);
             }
-            pos.appendBase(newAlignment.bases[i], newAlignment);
         }
     }
 
-    void appendSync(string line) {
-        tmpAlignment.parse(line);
+    /**
+     * parse one SAM line, tokenized by SAMTokenizer, move the window to it
+     * and append it. return false if the line is unmapped and skipped. with
+     * regions, the line out of the regions is skipped too.
+     */
+    bool appendSync(const char *line, const uint32_t *fieldEnds, int nFields) {
+        if (!tmpAlignment.parse<Policy>(line, fieldEnds, nFields)) {
+            if (readStats != NULL) {
+                readStats->countUnmapped();
+            }
+            return false;
+        }
+        if (regions == NULL) {
+            moveTo(tmpAlignment.contig, tmpAlignment.location);
+        } else if (!moveToRegion(tmpAlignment.contig, tmpAlignment.location,
+                                 tmpAlignment.cigarString.getCoveredLength())) {
+            if (readStats != NULL) {
+                readStats->countOutOfRegions();
+            }
+            return true;
+        }
         appendPositions(tmpAlignment);
+        return true;
     }
 };
 
@@ -0,0 +1,545 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REFERENCE_3N_TABLE_H
+#define REFERENCE_3N_TABLE_H
+
+#include "utility_3n_table.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+const char referenceCacheMagic[8] = {'H', '3', 'N', 'R', 'E', 'F', '2', '\0'};
+const char *const referenceCacheSuffix = ".3nref";
+const int referenceCacheBlock = 4096; // bases decoded by one getBases call.
+
+/**
+ * the reference cache (<ref>.3nref) made by "hisat-3n-table index". the file
+ * has this header, the chromosome table, the chromosome names, the 2-bit
+ * packed sequence (A, C, G, T, 4 bases per byte, low bits first) and the runs
+ * of bases which are not uppercase ACGT.
+ */
+struct ReferenceCacheHeader {
+    char magic[8];
+    uint64_t fastaSize;  // the reference file the cache is made from.
+    int64_t fastaMtime;  // seconds.
+    int64_t fastaMtimeNs;
+    uint64_t fastaInode;
+    uint64_t nChromosomes;
+    uint64_t chromosomesOffset;
+    uint64_t namesOffset;
+    uint64_t sequenceOffset;
+    uint64_t runsOffset;
+};
+
+struct ReferenceCacheChromosome {
+    uint64_t nameOffset; // from namesOffset.
+    uint64_t nameLength;
+    uint64_t length;
+    uint64_t fastaOffset; // the .fai record.
+    uint32_t lineBases;
+    uint32_t lineBytes;
+    uint64_t sequenceOffset; // from sequenceOffset, in bytes.
+    uint64_t runBegin;
+    uint64_t runEnd;
+};
+
+/**
+ * length bases from start are lowercase (of the packed bases), or they are
+ * all the base character (N, IUPAC code, ...).
+ */
+struct ReferenceCacheRun {
+    uint64_t start;
+    uint32_t length;
+    char base;
+    char lowercase;
+    char pad[2];
+};
+
+/**
+ * memory mapped reference (FASTA) file with samtools style index (.fai). the
+ * index gives the offset of each chromosome and its line layout, so any base
+ * is found in O(1). the index is built if it does not exist. if there is a
+ * reference cache next to the reference file and it is not stale, the cache
+ * is mapped instead.
+ */
+class ReferenceFile {
+  private:
+    const char *data;
+    size_t size;
+    string mappedFileName;
+    const ReferenceCacheHeader *cacheHeader; // NULL if FASTA is mapped.
+    const ReferenceCacheChromosome *cacheChromosomes;
+    const unsigned char *cacheSequence;
+    const ReferenceCacheRun *cacheRuns;
+    char buffer[referenceCacheBlock];
+
+    /**
+     * find the end of the line start at p. the end is '\n' or the end of file.
+     */
+    const char *lineEnd(const char *p) {
+        const char *end = data + size;
+        const char *newline = (const char *)memchr(p, '\n', end - p);
+        return newline == NULL ? end : newline;
+    }
+
+    /**
+     * given reference line (start with '>'), extract the chromosome
+     * information. this is important when there is space in chromosome name.
+     * the SAM information only contain the first word.
+     */
+    string getChrName(const char *line, const char *end) {
+        const char *p = line + 1;
+        while (p < end && !isspace(*p)) {
+            p++;
+        }
+        return string(line + 1, p);
+    }
+
+    /**
+     * scan the mapped reference file, record each chromosome as .fai does.
+     */
+    void buildIndex(const string &fileName,
+                    ChromosomeFilePositions &chromosomePos) {
+        const char *p = data;
+        const char *end = data + size;
+        ChromosomeFilePosition *current = NULL;
+        bool lastLine = false; // a shorter line is the last one of sequence.
+        while (p < end) {
+            const char *e = lineEnd(p);
+            int lineBytes = e - p + (e < end);
+            int lineBases = e - p - (e > p && e[-1] == '\r');
+            if (*p == '>') {
+                chromosomePos.pos.push_back(
+                    ChromosomeFilePosition(getChrName(p, e), e + 1 - data));
+                current = &chromosomePos.pos.back();
+                current->id = chromosomePos.pos.size() - 1;
+                lastLine = false;
+            } else if (current != NULL && lineBases > 0) {
+                if (current->lineBases == 0) {
+                    current->lineBases = lineBases;
+                    current->lineBytes = lineBytes;
+                } else if (lastLine || lineBases > current->lineBases ||
+                           (e < end && lineBytes - lineBases !=
+                                           current->lineBytes -
+                                               current->lineBases)) {
+                    cerr << "Different line length in chromosome "
+                         << current->chromosome << " of reference file "
+                         << fileName << endl;
+                    throw 1;
+                }
+                lastLine = lineBases < current->lineBases;
+                current->length += lineBases;
+            } else if (current != NULL) {
+                lastLine = true; // empty line, only allowed at the end.
+            }
+            p = e + 1;
+        }
+    }
+
+    /**
+     * load the .fai file. return false if it is not usable.
+     */
+    bool loadIndex(const string &indexFileName,
+                   ChromosomeFilePositions &chromosomePos) {
+        ifstream indexFile(indexFileName);
+        if (!indexFile.good()) {
+            return false;
+        }
+        string line;
+        while (getline(indexFile, line)) {
+            if (line.empty()) {
+                continue;
+            }
+            istringstream fields(line);
+            string name;
+            long long int length, offset, lineBases, lineBytes;
+            if (!getline(fields, name, '\t') ||
+                !(fields >> length >> offset >> lineBases >> lineBytes) ||
+                offset < 0 || (size_t)offset > size || lineBases <= 0 ||
+                lineBytes < lineBases) {
+                chromosomePos.pos.clear();
+                return false;
+            }
+            chromosomePos.pos.push_back(ChromosomeFilePosition(name, offset));
+            ChromosomeFilePosition &chr = chromosomePos.pos.back();
+            chr.id = chromosomePos.pos.size() - 1;
+            chr.length = length;
+            chr.lineBases = lineBases;
+            chr.lineBytes = lineBytes;
+        }
+        return !chromosomePos.pos.empty();
+    }
+
+    /**
+     * save the index. it is written to a temporary file then renamed, so other
+     * processes starting at the same time never read a partial index.
+     */
+    void writeIndex(const string &indexFileName,
+                    ChromosomeFilePositions &chromosomePos) {
+        string tempFileName = indexFileName + "." + to_string(getpid());
+        ofstream indexFile(tempFileName);
+        if (!indexFile.good()) {
+            return; // the index is only kept in memory.
+        }
+        for (size_t i = 0; i < chromosomePos.pos.size(); i++) {
+            ChromosomeFilePosition &chr = chromosomePos.pos[i];
+            indexFile << chr.chromosome << '\t' << chr.length << '\t'
+                      << chr.linePos << '\t' << chr.lineBases << '\t'
+                      << chr.lineBytes << '\n';
+        }
+        indexFile.close();
+        if (indexFile.fail() ||
+            rename(tempFileName.c_str(), indexFileName.c_str()) != 0) {
+            remove(tempFileName.c_str());
+        }
+    }
+
+    /**
+     * set the cache pointers if the mapped file is a reference cache made
+     * from a reference file of fastaSize, fastaMtime (s, ns) and fastaInode.
+     */
+    bool checkCache(uint64_t fastaSize, int64_t fastaMtime,
+                    int64_t fastaMtimeNs, uint64_t fastaInode) {
+        cacheHeader = (const ReferenceCacheHeader *)data;
+        if (size < sizeof(ReferenceCacheHeader) ||
+            memcmp(cacheHeader->magic, referenceCacheMagic, 8) != 0 ||
+            cacheHeader->runsOffset > size ||
+            cacheHeader->fastaSize != fastaSize ||
+            cacheHeader->fastaMtime != fastaMtime ||
+            cacheHeader->fastaMtimeNs != fastaMtimeNs ||
+            cacheHeader->fastaInode != fastaInode) {
+            cacheHeader = NULL;
+            return false;
+        }
+        cacheChromosomes = (const ReferenceCacheChromosome *)(
+            data + cacheHeader->chromosomesOffset);
+        cacheSequence = (const unsigned char *)(data + cacheHeader->sequenceOffset);
+        cacheRuns = (const ReferenceCacheRun *)(data + cacheHeader->runsOffset);
+        return true;
+    }
+
+    /**
+     * map the reference cache of fileName if it exists and is made from
+     * the current reference file. fill chromosomePos from the cache.
+     */
+    bool openCache(const string &fileName, ChromosomeFilePositions &chromosomePos) {
+        string cacheFileName = fileName + referenceCacheSuffix;
+        struct stat refStat, cacheStat;
+        if (stat(fileName.c_str(), &refStat) != 0 ||
+            stat(cacheFileName.c_str(), &cacheStat) != 0) {
+            return false;
+        }
+        map(cacheFileName);
+        if (!checkCache(refStat.st_size, refStat.st_mtim.tv_sec,
+                        refStat.st_mtim.tv_nsec, refStat.st_ino)) {
+            cerr << "Warning: the reference cache " << cacheFileName
+                 << " is stale, please run \"hisat-3n-table index " << fileName
+                 << "\" again. The reference file is used." << endl;
+            close();
+            return false;
+        }
+        chromosomePos.pos.clear();
+        for (uint64_t i = 0; i < cacheHeader->nChromosomes; i++) {
+            const ReferenceCacheChromosome &c = cacheChromosomes[i];
+            chromosomePos.pos.push_back(ChromosomeFilePosition(
+                string(data + cacheHeader->namesOffset + c.nameOffset,
+                       c.nameLength),
+                c.fastaOffset));
+            ChromosomeFilePosition &chr = chromosomePos.pos.back();
+            chr.id = i;
+            chr.length = c.length;
+            chr.lineBases = c.lineBases;
+            chr.lineBytes = c.lineBytes;
+        }
+        return true;
+    }
+
+    /**
+     * decode n bases from 0-based location of chromosome id in the cache.
+     */
+    void decodeCache(int id, long long int location, int n, char *output) {
+        static const char *bases = "ACGT";
+        const ReferenceCacheChromosome &c = cacheChromosomes[id];
+        const unsigned char *packed = cacheSequence + c.sequenceOffset;
+        for (int i = 0; i < n; i++) {
+            long long int p = location + i;
+            output[i] = bases[(packed[p >> 2] >> ((p & 3) * 2)) & 3];
+        }
+        // find the first run which ends after location.
+        const ReferenceCacheRun *run = cacheRuns + c.runBegin;
+        const ReferenceCacheRun *runEnd = cacheRuns + c.runEnd;
+        run = upper_bound(run, runEnd, location,
+                          [](long long int l, const ReferenceCacheRun &r) {
+                              return l < (long long int)r.start;
+                          });
+        if (run != cacheRuns + c.runBegin) {
+            run--;
+        }
+        for (; run != runEnd && (long long int)run->start < location + n; run++) {
+            long long int begin = max((long long int)run->start, location);
+            long long int end =
+                min((long long int)(run->start + run->length), location + n);
+            for (long long int p = begin; p < end; p++) {
+                char &b = output[p - location];
+                b = run->lowercase ? tolower(b) : run->base;
+            }
+        }
+    }
+
+  public:
+    ReferenceFile()
+        : data(NULL), size(0), cacheHeader(NULL), cacheChromosomes(NULL),
+          cacheSequence(NULL), cacheRuns(NULL) {}
+
+    ~ReferenceFile() { close(); }
+
+    /**
+     * map the file.
+     */
+    void map(const string &fileName) {
+        close();
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            cerr << "Cannot open the reference file: " << fileName << endl;
+            throw 1;
+        }
+        size = st.st_size;
+        if (size > 0) {
+            void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                cerr << "Cannot map the reference file: " << fileName << endl;
+                throw 1;
+            }
+            data = (const char *)p;
+        }
+        ::close(fd);
+        mappedFileName = fileName;
+    }
+
+    /**
+     * map the same file as other, for another thread.
+     */
+    void open(const ReferenceFile &other) {
+        map(other.mappedFileName);
+        if (other.cacheHeader != NULL) {
+            const ReferenceCacheHeader &header = *other.cacheHeader;
+            checkCache(header.fastaSize, header.fastaMtime, header.fastaMtimeNs,
+                       header.fastaInode);
+        }
+    }
+
+    /**
+     * map the reference file and get the chromosomes in file order. use the
+     * reference cache if it is ready. otherwise use the .fai. if the .fai
+     * does not exist or is older than the reference file, build it and try
+     * to save it.
+     */
+    void open(const string &fileName, ChromosomeFilePositions &chromosomePos,
+              bool useCache = true) {
+        if (useCache && openCache(fileName, chromosomePos)) {
+            return;
+        }
+        map(fileName);
+        string indexFileName = fileName + ".fai";
+        struct stat refStat, indexStat;
+        // the index is written after the reference file is read, so it is
+        // newer unless the reference file is changed after it.
+        bool fresh = stat(fileName.c_str(), &refStat) == 0 &&
+                     stat(indexFileName.c_str(), &indexStat) == 0 &&
+                     (indexStat.st_mtim.tv_sec > refStat.st_mtim.tv_sec ||
+                      (indexStat.st_mtim.tv_sec == refStat.st_mtim.tv_sec &&
+                       indexStat.st_mtim.tv_nsec > refStat.st_mtim.tv_nsec));
+        chromosomePos.pos.clear();
+        if (!fresh || !loadIndex(indexFileName, chromosomePos)) {
+            buildIndex(fileName, chromosomePos);
+            writeIndex(indexFileName, chromosomePos);
+        }
+    }
+
+    void close() {
+        if (data != NULL) {
+            munmap((void *)data, size);
+        }
+        data = NULL;
+        size = 0;
+        cacheHeader = NULL;
+    }
+
+    /**
+     * return the address of base at 0-based location of chr. n is set to the
+     * number of bases after it in the same line (not beyond chromosome end).
+     * for the reference cache, at most referenceCacheBlock bases are decoded.
+     */
+    inline const char *getBases(const ChromosomeFilePosition &chr,
+                                long long int location, int &n) {
+        if (cacheHeader != NULL) {
+            n = min((long long int)referenceCacheBlock, chr.length - location);
+            decodeCache(chr.id, location, n, buffer);
+            return buffer;
+        }
+        long long int line = location / chr.lineBases;
+        int column = location % chr.lineBases;
+        long long int offset = chr.linePos + line * chr.lineBytes + column;
+        n = min((long long int)(chr.lineBases - column), chr.length - location);
+        if (offset + n > (long long int)size) {
+            cerr << "The reference file does not match its index (.fai) at "
+                 << chr.chromosome << endl;
+            throw 1;
+        }
+        return data + offset;
+    }
+
+    /**
+     * the 2-bit code of base (A, C, G, T in either case), or -1.
+     */
+    static int getBaseCode(char base) {
+        switch (toupper(base)) {
+        case 'A': return 0;
+        case 'C': return 1;
+        case 'G': return 2;
+        case 'T': return 3;
+        default: return -1;
+        }
+    }
+
+    /**
+     * make the reference cache of fileName, for "hisat-3n-table index".
+     */
+    static void buildCache(const string &fileName) {
+        ReferenceFile reference;
+        ChromosomeFilePositions chromosomePos;
+        reference.open(fileName, chromosomePos, false);
+        struct stat refStat;
+        stat(fileName.c_str(), &refStat);
+
+        vector<ReferenceCacheChromosome> chromosomes(chromosomePos.pos.size());
+        vector<ReferenceCacheRun> runs;
+        string names;
+        uint64_t sequenceSize = 0;
+        for (size_t i = 0; i < chromosomes.size(); i++) {
+            ChromosomeFilePosition &chr = chromosomePos.pos[i];
+            ReferenceCacheChromosome &c = chromosomes[i];
+            memset(&c, 0, sizeof(c));
+            c.nameOffset = names.size();
+            c.nameLength = chr.chromosome.size();
+            names += chr.chromosome;
+            c.length = chr.length;
+            c.fastaOffset = chr.linePos;
+            c.lineBases = chr.lineBases;
+            c.lineBytes = chr.lineBytes;
+            c.sequenceOffset = sequenceSize;
+            sequenceSize += (chr.length + 3) / 4;
+        }
+
+        ReferenceCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, referenceCacheMagic, 8);
+        header.fastaSize = refStat.st_size;
+        header.fastaMtime = refStat.st_mtim.tv_sec;
+        header.fastaMtimeNs = refStat.st_mtim.tv_nsec;
+        header.fastaInode = refStat.st_ino;
+        header.nChromosomes = chromosomes.size();
+        header.chromosomesOffset = sizeof(header);
+        header.namesOffset =
+            header.chromosomesOffset + chromosomes.size() * sizeof(chromosomes[0]);
+        header.sequenceOffset = (header.namesOffset + names.size() + 7) / 8 * 8;
+        header.runsOffset = (header.sequenceOffset + sequenceSize + 7) / 8 * 8;
+
+        string cacheFileName = fileName + referenceCacheSuffix;
+        string tempFileName = cacheFileName + "." + to_string(getpid());
+        ofstream cache(tempFileName, ios_base::out | ios_base::binary);
+        if (!cache.good()) {
+            cerr << "Cannot write the reference cache: " << cacheFileName << endl;
+            throw 1;
+        }
+        cache.seekp(header.namesOffset);
+        cache.write(names.data(), names.size());
+        cache.seekp(header.sequenceOffset);
+
+        vector<unsigned char> packed;
+        for (size_t i = 0; i < chromosomes.size(); i++) {
+            ChromosomeFilePosition &chr = chromosomePos.pos[i];
+            chromosomes[i].runBegin = runs.size();
+            packed.assign((chr.length + 3) / 4, 0);
+            long long int location = 0;
+            while (location < chr.length) {
+                int n;
+                const char *bases = reference.getBases(chr, location, n);
+                for (int j = 0; j < n; j++, location++) {
+                    char b = bases[j];
+                    int code = getBaseCode(b);
+                    if (code >= 0) {
+                        packed[location >> 2] |= code << ((location & 3) * 2);
+                    }
+                    if (code >= 0 && b == toupper(b)) {
+                        continue;
+                    }
+                    // this base is kept in a run.
+                    bool lowercase = code >= 0;
+                    ReferenceCacheRun *last = runs.size() > chromosomes[i].runBegin
+                                                  ? &runs.back() : NULL;
+                    if (last != NULL &&
+                        (long long int)(last->start + last->length) == location &&
+                        last->lowercase == lowercase &&
+                        (lowercase || last->base == b) && last->length < UINT32_MAX) {
+                        last->length++;
+                    } else {
+                        ReferenceCacheRun run;
+                        memset(&run, 0, sizeof(run));
+                        run.start = location;
+                        run.length = 1;
+                        run.base = b;
+                        run.lowercase = lowercase;
+                        runs.push_back(run);
+                    }
+                }
+            }
+            chromosomes[i].runEnd = runs.size();
+            cache.write((const char *)packed.data(), packed.size());
+        }
+        cache.seekp(header.runsOffset);
+        cache.write((const char *)runs.data(), runs.size() * sizeof(runs[0]));
+        cache.seekp(0);
+        cache.write((const char *)&header, sizeof(header));
+        cache.write((const char *)chromosomes.data(),
+                    chromosomes.size() * sizeof(chromosomes[0]));
+        cache.close();
+        if (cache.fail() ||
+            rename(tempFileName.c_str(), cacheFileName.c_str()) != 0) {
+            remove(tempFileName.c_str());
+            cerr << "Cannot write the reference cache: " << cacheFileName << endl;
+            throw 1;
+        }
+        cerr << "The reference cache is saved to " << cacheFileName << endl;
+    }
+};
+
+#endif // REFERENCE_3N_TABLE_H
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REGIONS_3N_TABLE_H
+#define REGIONS_3N_TABLE_H
+
+#include "contig_3n_table.h"
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * one target region, [begin, end) 0-based, as in BED.
+ */
+class Region {
+  public:
+    long long int begin;
+    long long int end;
+
+    bool operator<(const Region &other) const { return begin < other.begin; }
+};
+
+/**
+ * the target regions of --regions, from a BED file. the regions of each
+ * contig id are sorted and merged. the sorted alignments are checked against
+ * the first region of their contig which is not finished yet, so only the
+ * alignments which can reach a region are counted.
+ */
+class RegionSet {
+  public:
+    vector<vector<Region>> regions; // of each contig id.
+    vector<size_t> next; // the first region of each contig not finished.
+
+    /**
+     * load the BED file fileName, the chromosome of each line is one of
+     * nContigs contigs in contigs. the lines of header, track and browser are
+     * skipped.
+     */
+    void load(const string &fileName, const ContigDictionary &contigs,
+              int nContigs) {
+        ifstream file(fileName);
+        if (!file.is_open()) {
+            cerr << "Cannot open the region file: " << fileName << endl;
+            throw 1;
+        }
+        regions.assign(nContigs, vector<Region>());
+        next.assign(nContigs, 0);
+        string line;
+        while (getline(file, line)) {
+            if (line.empty() || line[0] == '#' || line.compare(0, 5, "track") == 0 ||
+                line.compare(0, 7, "browser") == 0) {
+                continue;
+            }
+            istringstream fields(line);
+            string chromosome;
+            Region region;
+            if (!(fields >> chromosome >> region.begin >> region.end) ||
+                region.begin < 0 || region.end < region.begin) {
+                cerr << "The region file has a broken line: " << line << endl;
+                throw 1;
+            }
+            if (region.end > region.begin) {
+                regions[contigs.get(chromosome)].push_back(region);
+            }
+        }
+        for (size_t i = 0; i < regions.size(); i++) {
+            merge(regions[i]);
+        }
+    }
+
+    /**
+     * sort the regions and merge the ones which overlap or touch.
+     */
+    static void merge(vector<Region> &list) {
+        sort(list.begin(), list.end());
+        size_t n = 0;
+        for (size_t i = 0; i < list.size(); i++) {
+            if (n > 0 && list[i].begin <= list[n - 1].end) {
+                list[n - 1].end = max(list[n - 1].end, list[i].end);
+            } else {
+                list[n++] = list[i];
+            }
+        }
+        list.resize(n);
+    }
+
+    /**
+     * the alignment of contig at 1-based location covers coveredLength bp.
+     * skip the regions of contig which end before it, then return the
+     * location to move the window to: location, or the start of the next
+     * region if the alignment starts before it. return -1 if the alignment
+     * cannot reach a region.
+     */
+    inline long long int find(int contig, long long int location,
+                              long long int coveredLength) {
+        const vector<Region> &list = regions[contig];
+        size_t &i = next[contig];
+        while (i < list.size() && list[i].end < location) {
+            i++;
+        }
+        if (i == list.size() || location + coveredLength - 1 <= list[i].begin) {
+            return -1;
+        }
+        return max(location, list[i].begin + 1);
+    }
+
+    /**
+     * return true if every region of contig is finished.
+     */
+    inline bool finished(int contig) { return next[contig] == regions[contig].size(); }
+
+    /**
+     * the mask of the n (at most 64) locations from the 1-based location of
+     * contig, bit k is set if location + k is in a region.
+     */
+    inline uint64_t getMask(int contig, long long int location, int n) const {
+        const vector<Region> &list = regions[contig];
+        long long int first = location - 1; // 0-based [first, last).
+        long long int last = first + n;
+        size_t i = upper_bound(list.begin(), list.end(), first,
+                               [](long long int p, const Region &region) {
+                                   return p < region.end;
+                               }) -
+                   list.begin();
+        uint64_t mask = 0;
+        for (; i < list.size() && list[i].begin < last; i++) {
+            int a = max(list[i].begin, first) - first;
+            int b = min(list[i].end, last) - first;
+            mask |= (b - a == 64 ? ~0ULL : ((1ULL << (b - a)) - 1) << a);
+        }
+        return mask;
+    }
+};
+
+#endif // REGIONS_3N_TABLE_H
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMD_3N_TABLE_H
+#define SIMD_3N_TABLE_H
+
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+/**
+ * classify 64 reference bases into the strand masks: bit k of plus is set if
+ * bases[k] is from, and bit k of minus if it is complement. the lowercase
+ * (soft-masked) bases are the same as the uppercase. from and complement are
+ * uppercase letters.
+ */
+typedef void (*ClassifyFunction)(const char *bases, char from, char complement,
+                                 uint64_t &plus, uint64_t &minus);
+
+inline void classifyBasesScalar(const char *bases, char from, char complement,
+                                uint64_t &plus, uint64_t &minus) {
+    // the case bit (0x20) only changes the case of letters.
+    char lowerFrom = from | 0x20;
+    char lowerComplement = complement | 0x20;
+    plus = minus = 0;
+    for (int k = 0; k < 64; k++) {
+        char b = bases[k] | 0x20;
+        plus |= (uint64_t)(b == lowerFrom) << k;
+        minus |= (uint64_t)(b == lowerComplement) << k;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+inline void classifyBasesSSE2(const char *bases, char from, char complement,
+                              uint64_t &plus, uint64_t &minus) {
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    const __m128i lowerFrom = _mm_set1_epi8(from | 0x20);
+    const __m128i lowerComplement = _mm_set1_epi8(complement | 0x20);
+    plus = minus = 0;
+    for (int k = 0; k < 64; k += 16) {
+        __m128i b = _mm_or_si128(
+            _mm_loadu_si128((const __m128i *)(bases + k)), caseBit);
+        plus |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                    _mm_cmpeq_epi8(b, lowerFrom)) << k;
+        minus |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                     _mm_cmpeq_epi8(b, lowerComplement)) << k;
+    }
+}
+
+__attribute__((target("avx2"))) inline void
+classifyBasesAVX2(const char *bases, char from, char complement,
+                  uint64_t &plus, uint64_t &minus) {
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    const __m256i lowerFrom = _mm256_set1_epi8(from | 0x20);
+    const __m256i lowerComplement = _mm256_set1_epi8(complement | 0x20);
+    plus = minus = 0;
+    for (int k = 0; k < 64; k += 32) {
+        __m256i b = _mm256_or_si256(
+            _mm256_loadu_si256((const __m256i *)(bases + k)), caseBit);
+        plus |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                    _mm256_cmpeq_epi8(b, lowerFrom)) << k;
+        minus |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                     _mm256_cmpeq_epi8(b, lowerComplement)) << k;
+    }
+}
+#endif
+
+/**
+ * the classify kernel of this CPU: AVX2 if it is supported, otherwise SSE2
+ * (the build baseline).
+ */
+inline ClassifyFunction getClassifyFunction() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const ClassifyFunction function =
+        __builtin_cpu_supports("avx2") ? classifyBasesAVX2 : classifyBasesSSE2;
+    return function;
+#else
+    return classifyBasesScalar;
+#endif
+}
+
+/**
+ * the mask of the SAM delimiters (tab and newline) in 64 bytes: bit k is set
+ * if p[k] is '\t' or '\n'.
+ */
+typedef uint64_t (*DelimiterFunction)(const char *p);
+
+inline uint64_t findDelimitersScalar(const char *p) {
+    uint64_t mask = 0;
+    for (int k = 0; k < 64; k++) {
+        mask |= (uint64_t)(p[k] == '\t' || p[k] == '\n') << k;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+inline uint64_t findDelimitersSSE2(const char *p) {
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    uint64_t mask = 0;
+    for (int k = 0; k < 64; k += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + k));
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(b, tab),
+                                     _mm_cmpeq_epi8(b, newline));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(found) << k;
+    }
+    return mask;
+}
+
+__attribute__((target("avx2"))) inline uint64_t
+findDelimitersAVX2(const char *p) {
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    uint64_t mask = 0;
+    for (int k = 0; k < 64; k += 32) {
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + k));
+        __m256i found = _mm256_or_si256(_mm256_cmpeq_epi8(b, tab),
+                                        _mm256_cmpeq_epi8(b, newline));
+        mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(found) << k;
+    }
+    return mask;
+}
+#endif
+
+/**
+ * the delimiter kernel of this CPU, chosen like getClassifyFunction.
+ */
+inline DelimiterFunction getDelimiterFunction() {
+#if defined(__x86_64__) || defined(__i386__)
+    static const DelimiterFunction function =
+        __builtin_cpu_supports("avx2") ? findDelimitersAVX2 : findDelimitersSSE2;
+    return function;
+#else
+    return findDelimitersScalar;
+#endif
+}
+
+/**
+ * return the uppercase of the reference base, soft-masked bases are
+ * lowercase.
+ */
+inline char upperBase(char base) {
+    return base >= 'a' && base <= 'z' ? base - ('a' - 'A') : base;
+}
+
+/**
+ * the number of set bits in x. with POPCNT_CAPABILITY (set by the Makefile,
+ * as in HISAT2) the popcnt instruction is used, the builtin alone is a long
+ * bit trick without -mpopcnt.
+ */
+inline int popcount64(uint64_t x) {
+#if defined(POPCNT_CAPABILITY) && defined(__x86_64__)
+    uint64_t count;
+    asm("popcntq %1, %0" : "=r"(count) : "r"(x));
+    return count;
+#else
+    return __builtin_popcountll(x);
+#endif
+}
+
+#endif // SIMD_3N_TABLE_H
@@ -0,0 +1,354 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATS_3N_TABLE_H
+#define STATS_3N_TABLE_H
+
+#include "alignment_3n_table.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+using namespace std;
+
+/**
+ * the stages timed by --stats. parse includes counting the bases of the
+ * parsed alignments; the stages do not overlap in one thread.
+ */
+enum Stage { stageInput, stageParse, stageReference, stageOutput, nStages };
+const char *const stageNames[nStages] = {"input", "parse", "reference",
+                                         "output"};
+
+/**
+ * the counted reads and bases of one contig.
+ */
+class ContigCounts {
+  public:
+    long long int reads = 0;
+    long long int bases = 0;
+    long long int converted = 0;
+};
+
+/**
+ * the counters of the alignment records. one thread uses one ReadStats,
+ * they are added together at the end.
+ */
+class ReadStats {
+  public:
+    long long int records = 0;  // SAM lines or BAM records (no header).
+    long long int unmapped = 0; // unmapped or broken records.
+    long long int filtered = 0; // not counted by the u|m tables.
+    long long int tooLong = 0;  // skipped for covering > maxCoveredLength.
+    long long int outOfRegions = 0; // skipped by --regions.
+    long long int counted = 0;  // the reads counted.
+    long long int bases = 0;    // the bases counted, converted or not.
+    long long int converted = 0;
+    vector<ContigCounts> contigs; // of each chromosome index in Positions.
+
+    /**
+     * count one record after it is parsed (and scanned if parsed is set),
+     * with its counted bases. return true if the read is counted.
+     */
+    template <typename Policy>
+    inline bool countRecord(Alignment &alignment, bool parsed, int nBases,
+                            int nConverted) {
+        records++;
+        if (!parsed || !alignment.mapped) {
+            unmapped++;
+        } else if (alignment.isFiltered<Policy>()) {
+            filtered++;
+        } else if (alignment.sequenceCoveredLength > maxCoveredLength) {
+            tooLong++;
+        } else {
+            counted++;
+            bases += nBases;
+            converted += nConverted;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * count one record which is not parsed (unmapped).
+     */
+    inline void countUnmapped() {
+        records++;
+        unmapped++;
+    }
+
+    /**
+     * count one mapped record which cannot reach a region of --regions.
+     */
+    inline void countOutOfRegions() {
+        records++;
+        outOfRegions++;
+    }
+
+    /**
+     * count one counted read of contig.
+     */
+    inline void countContig(int contig, int nBases, int nConverted) {
+        if (contig >= (int)contigs.size()) {
+            contigs.resize(contig + 1);
+        }
+        contigs[contig].reads++;
+        contigs[contig].bases += nBases;
+        contigs[contig].converted += nConverted;
+    }
+
+    /**
+     * add the counters except contigs.
+     */
+    void addRecords(const ReadStats &other) {
+        records += other.records;
+        unmapped += other.unmapped;
+        filtered += other.filtered;
+        tooLong += other.tooLong;
+        outOfRegions += other.outOfRegions;
+        counted += other.counted;
+        bases += other.bases;
+        converted += other.converted;
+    }
+
+    void add(const ReadStats &other) {
+        addRecords(other);
+        for (size_t i = 0; i < other.contigs.size(); i++) {
+            if (other.contigs[i].reads == 0) {
+                continue;
+            }
+            if (i >= contigs.size()) {
+                contigs.resize(i + 1);
+            }
+            contigs[i].reads += other.contigs[i].reads;
+            contigs[i].bases += other.contigs[i].bases;
+            contigs[i].converted += other.contigs[i].converted;
+        }
+    }
+};
+
+/**
+ * the wall and CPU time (nanoseconds) of one stage, summed over threads. with
+ * several threads in a stage, the wall time can be more than the run's.
+ */
+class StageTime {
+  public:
+    atomic<long long int> wall{0};
+    atomic<long long int> cpu{0};
+};
+
+inline long long int wallClock() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+inline long long int threadCPUClock() {
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/**
+ * the statistics of a run, for --stats and --progress. runStats is NULL if
+ * neither is set, then nothing is counted or timed.
+ */
+class RunStats {
+  private:
+    /**
+     * the JSON string of s, without the quotes.
+     */
+    static string escape(const string &s) {
+        string escaped;
+        for (size_t i = 0; i < s.size(); i++) {
+            unsigned char c = s[i];
+            if (c == '"' || c == '\\') {
+                escaped += '\\';
+                escaped += c;
+            } else if (c < 0x20) {
+                char buff[8];
+                snprintf(buff, sizeof(buff), "\\u%04x", c);
+                escaped += buff;
+            } else {
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+  public:
+    StageTime stages[nStages];
+    ReadStats reads;         // added by the thread which moves the window.
+    vector<long long int> rows; // of each table.
+    long long int startTime = wallClock();
+    bool progress = false;
+    long long int lastProgress = startTime;
+
+    /**
+     * write the statistics as JSON to fileName. tables are the description
+     * of each table, the contigs are named by chromosomePos and output in
+     * the order of reference file.
+     */
+    void write(const string &fileName, const string &command,
+               const vector<string> &tables,
+               const ChromosomeFilePositions &chromosomePos) {
+        FILE *file = fopen(fileName.c_str(), "w");
+        if (file == NULL) {
+            cerr << "Cannot open the stats file: " << fileName << endl;
+            throw 1;
+        }
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        fprintf(file, "{\n  \"command\": \"%s\",\n", escape(command).c_str());
+        fprintf(file, "  \"wall_seconds\": %.3f,\n",
+                (wallClock() - startTime) / 1e9);
+        fprintf(file, "  \"cpu_seconds\": %.3f,\n",
+                usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6);
+        fprintf(file, "  \"max_rss_kb\": %ld,\n", usage.ru_maxrss);
+        fprintf(file, "  \"stages\": {");
+        for (int i = 0; i < nStages; i++) {
+            fprintf(file,
+                    "%s\n    \"%s\": {\"thread_wall_seconds\": %.3f, "
+                    "\"thread_cpu_seconds\": %.3f}",
+                    i > 0 ? "," : "", stageNames[i], stages[i].wall / 1e9,
+                    stages[i].cpu / 1e9);
+        }
+        fprintf(file, "\n  },\n");
+        fprintf(file,
+                "  \"records\": {\"total\": %lld, \"unmapped\": %lld, "
+                "\"filtered\": %lld, \"too_long\": %lld, "
+                "\"out_of_regions\": %lld, \"counted\": %lld},\n",
+                reads.records, reads.unmapped, reads.filtered, reads.tooLong,
+                reads.outOfRegions, reads.counted);
+        fprintf(file, "  \"bases\": {\"counted\": %lld, \"converted\": %lld},\n",
+                reads.bases, reads.converted);
+        fprintf(file, "  \"tables\": [");
+        for (size_t t = 0; t < tables.size(); t++) {
+            fprintf(file, "%s\n    {\"table\": \"%s\", \"rows\": %lld}",
+                    t > 0 ? "," : "", escape(tables[t]).c_str(),
+                    t < rows.size() ? rows[t] : 0LL);
+        }
+        fprintf(file, "\n  ],\n  \"contigs\": [");
+        vector<int> order;
+        for (size_t i = 0; i < reads.contigs.size(); i++) {
+            if (reads.contigs[i].reads > 0) {
+                order.push_back(i);
+            }
+        }
+        sort(order.begin(), order.end(), [&chromosomePos](int a, int b) {
+            return chromosomePos.pos[a].id < chromosomePos.pos[b].id;
+        });
+        for (size_t k = 0; k < order.size(); k++) {
+            const ContigCounts &contig = reads.contigs[order[k]];
+            fprintf(file,
+                    "%s\n    {\"name\": \"%s\", \"reads\": %lld, "
+                    "\"bases\": %lld, \"converted\": %lld}",
+                    k > 0 ? "," : "",
+                    escape(chromosomePos.pos[order[k]].chromosome).c_str(),
+                    contig.reads, contig.bases, contig.converted);
+        }
+        fprintf(file, "\n  ]\n}\n");
+        if (fclose(file) != 0) {
+            cerr << "Cannot write the stats file: " << fileName << endl;
+            throw 1;
+        }
+    }
+
+    /**
+     * print the throughput and the current contig to stderr, at most every
+     * progressInterval. call it with the records counted so far.
+     */
+    void reportProgress(const string &contig) {
+        const long long int progressInterval = 10000000000LL; // 10 s
+        if (!progress) {
+            return;
+        }
+        long long int now = wallClock();
+        if (now - lastProgress < progressInterval) {
+            return;
+        }
+        lastProgress = now;
+        double seconds = (now - startTime) / 1e9;
+        fprintf(stderr,
+                "[hisat-3n-table] %.0f s: %lld records (%.0f records/s), "
+                "%lld bases counted, at %s\n",
+                seconds, reads.records, reads.records / seconds, reads.bases,
+                contig.c_str());
+    }
+};
+
+extern RunStats *runStats;
+
+/**
+ * time the scope as stage in runStats. the time of the nested scopes is
+ * only counted in their stage.
+ */
+class StageTimer {
+  private:
+    StageTime *time;
+    StageTimer *outer;
+    long long int wallStart;
+    long long int cpuStart;
+
+    static StageTimer *&current() {
+        static thread_local StageTimer *timer = NULL;
+        return timer;
+    }
+
+    void pause(long long int wallNow, long long int cpuNow) {
+        time->wall += wallNow - wallStart;
+        time->cpu += cpuNow - cpuStart;
+    }
+
+  public:
+    explicit StageTimer(Stage stage) : time(NULL) {
+        if (runStats == NULL) {
+            return;
+        }
+        time = &runStats->stages[stage];
+        wallStart = wallClock();
+        cpuStart = threadCPUClock();
+        outer = current();
+        if (outer != NULL) {
+            outer->pause(wallStart, cpuStart);
+        }
+        current() = this;
+    }
+
+    ~StageTimer() {
+        if (time == NULL) {
+            return;
+        }
+        long long int wallNow = wallClock();
+        long long int cpuNow = threadCPUClock();
+        pause(wallNow, cpuNow);
+        current() = outer;
+        if (outer != NULL) {
+            outer->wallStart = wallNow;
+            outer->cpuStart = cpuNow;
+        }
+    }
+};
+
+#endif // STATS_3N_TABLE_H
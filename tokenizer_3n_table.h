@@ -0,0 +1,240 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TOKENIZER_3N_TABLE_H
+#define TOKENIZER_3N_TABLE_H
+
+#include "simd_3n_table.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+using namespace std;
+
+const size_t samBlockSize = 1 << 20; // the SAM text read in one block.
+
+/**
+ * one SAM line in a tokenized block: it is [begin, begin + length) of the
+ * block, without the newline (and '\r'). its fields end at
+ * fieldEnds[firstField, firstField + nFields), the offsets from begin of the
+ * tab after each field, or length for the last field.
+ */
+class SAMRecordView {
+  public:
+    size_t begin;
+    uint32_t length;
+    uint32_t firstField;
+    uint32_t nFields;
+};
+
+/**
+ * find the tabs and newlines of a block of SAM text in one pass, 64 bytes at
+ * a time with the delimiter kernel, and make the field table of each line.
+ * the parsers index into the table instead of searching the line again.
+ */
+class SAMTokenizer {
+  public:
+    vector<uint32_t> fieldEnds;
+    vector<SAMRecordView> records;
+    DelimiterFunction findDelimiters = getDelimiterFunction();
+
+    /**
+     * tokenize the lines of block. the text after the last newline is a line
+     * if final is set, otherwise it is left. return the length of the
+     * tokenized lines.
+     */
+    size_t tokenize(const char *block, size_t length, bool final = true) {
+        fieldEnds.clear();
+        records.clear();
+        size_t lineBegin = 0;
+        uint32_t firstField = 0;
+        for (size_t base = 0; base < length; base += 64) {
+            uint64_t mask;
+            if (length - base >= 64) {
+                mask = findDelimiters(block + base);
+            } else {
+                char word[64] = {0};
+                memcpy(word, block + base, length - base);
+                mask = findDelimiters(word);
+            }
+            while (mask != 0) {
+                size_t pos = base + __builtin_ctzll(mask);
+                mask &= mask - 1;
+                if (block[pos] == '\t') {
+                    fieldEnds.push_back(pos - lineBegin);
+                    continue;
+                }
+                addRecord(block, lineBegin, pos, firstField);
+                lineBegin = pos + 1;
+                firstField = fieldEnds.size();
+            }
+        }
+        if (final && lineBegin < length) {
+            addRecord(block, lineBegin, length, firstField);
+            lineBegin = length;
+            firstField = fieldEnds.size();
+        }
+        fieldEnds.resize(firstField);
+        return lineBegin;
+    }
+
+  private:
+    /**
+     * add the line [begin, end) with the fields from firstField.
+     */
+    inline void addRecord(const char *block, size_t begin, size_t end,
+                          uint32_t firstField) {
+        if (end > begin && block[end - 1] == '\r') {
+            end--;
+        }
+        fieldEnds.push_back(end - begin);
+        SAMRecordView record;
+        record.begin = begin;
+        record.length = end - begin;
+        record.firstField = firstField;
+        record.nFields = fieldEnds.size() - firstField;
+        records.push_back(record);
+    }
+};
+
+/**
+ * read SAM text in blocks of whole lines (about samBlockSize bytes). a
+ * longer line makes a larger block, so lines of any length are read whole.
+ * a regular file (a file path, or standard input redirected from a file) is
+ * memory mapped, and the blocks are views of the mapping without copying. a
+ * pipe is read into the caller's buffer, with large freads which are read(2)
+ * into the buffer directly.
+ */
+class SAMBlockReader {
+  private:
+    FILE *input = NULL;
+    vector<char> pending; // the incomplete line after the last block.
+    bool eof = false;
+    const char *mapped = NULL; // the mapping of a regular file.
+    size_t mappedSize = 0;
+    size_t mappedOffset = 0;   // the start of the next block.
+    long long int streamOffset = 0; // the file offset after the last read.
+
+    bool readMapped(const char *&data, size_t &length) {
+        if (mappedOffset >= mappedSize) {
+            return false;
+        }
+        size_t end = min(mappedOffset + samBlockSize, mappedSize);
+        const char *newline =
+            (const char *)memchr(mapped + end - 1, '\n', mappedSize - end + 1);
+        end = newline == NULL ? mappedSize : newline - mapped + 1;
+        data = mapped + mappedOffset;
+        length = end - mappedOffset;
+        blockOffset = mappedOffset;
+        mappedOffset = end;
+        return true;
+    }
+
+  public:
+    long long int blockOffset = 0; // the file offset of the last block.
+
+    ~SAMBlockReader() { close(); }
+
+    /**
+     * read from inputFile, from its current position. it is mapped if it is
+     * a regular file.
+     */
+    void open(FILE *inputFile) {
+        close();
+        input = inputFile;
+        pending.clear();
+        eof = false;
+        struct stat fileStat;
+        long offset = ftell(input);
+        streamOffset = max(offset, 0L);
+        if (fstat(fileno(input), &fileStat) != 0 || !S_ISREG(fileStat.st_mode) ||
+            offset < 0 || offset >= fileStat.st_size) {
+            return;
+        }
+        void *p = mmap(NULL, fileStat.st_size, PROT_READ, MAP_PRIVATE,
+                       fileno(input), 0);
+        if (p == MAP_FAILED) {
+            return; // read it as a stream.
+        }
+        madvise(p, fileStat.st_size, MADV_SEQUENTIAL);
+        mapped = (const char *)p;
+        mappedSize = fileStat.st_size;
+        mappedOffset = offset;
+    }
+
+    void close() {
+        if (mapped != NULL) {
+            munmap((void *)mapped, mappedSize);
+        }
+        mapped = NULL;
+        mappedSize = mappedOffset = 0;
+    }
+
+    /**
+     * get the next block of lines: [data, data + length). the block of a
+     * mapped file is valid until close, otherwise it is read into buffer.
+     * return false if there is no more text.
+     */
+    bool read(vector<char> &buffer, const char *&data, size_t &length) {
+        if (mapped != NULL) {
+            return readMapped(data, length);
+        }
+        buffer.swap(pending);
+        size_t bufferLength = buffer.size();
+        size_t lineEnd = 0; // after the last newline.
+        while (!eof) {
+            if (buffer.size() < bufferLength + samBlockSize) {
+                buffer.resize(max(bufferLength + samBlockSize, 2 * buffer.size()));
+            }
+            size_t n = fread(buffer.data() + bufferLength, 1,
+                             buffer.size() - bufferLength, input);
+            if (n == 0) {
+                if (ferror(input)) {
+                    cerr << "Cannot read the alignment file." << endl;
+                    throw 1;
+                }
+                eof = true;
+                break;
+            }
+            const void *newline =
+                memrchr(buffer.data() + bufferLength, '\n', n);
+            bufferLength += n;
+            if (newline != NULL) {
+                lineEnd = (const char *)newline - buffer.data() + 1;
+                break;
+            }
+        }
+        if (eof) {
+            lineEnd = bufferLength;
+        }
+        pending.assign(buffer.begin() + lineEnd, buffer.begin() + bufferLength);
+        blockOffset = streamOffset;
+        streamOffset += lineEnd;
+        data = buffer.data();
+        length = lineEnd;
+        return length > 0;
+    }
+};
+
+#endif // TOKENIZER_3N_TABLE_H
@@ -0,0 +1,412 @@
+/*
+ * Copyright 2020, Yun (Leo) Zhang <imzhangyun@gmail.com>
+ *
+ * This file is part of HISAT-3N.
+ *
+ * HISAT-3N is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT-3N is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT-3N.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNSORTED_3N_TABLE_H
+#define UNSORTED_3N_TABLE_H
+
+#include "output_3n_table.h"
+#include "reference_3n_table.h"
+#include "simd_3n_table.h"
+#include "utility_3n_table.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <queue>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+using namespace std;
+
+const long long int defaultUnsortedMemory = 2048; // MB
+const int unsortedLocationBits = 40;
+const size_t maxUnsortedRuns = 64; // the most runs merged at once.
+const size_t reservedFiles = 16;    // the other files open while merging.
+
+/**
+ * the counts of one position. key is (chromosome id << unsortedLocationBits)
+ * | 1-based location, so the keys are sorted in the order of the table.
+ */
+struct UnsortedCount {
+    uint64_t key;
+    uint32_t converted;
+    uint32_t unconverted;
+};
+
+/**
+ * one sorted run spilled to a temporary file, read back in the merge.
+ */
+class UnsortedRun {
+  public:
+    string fileName;
+    FILE *file = NULL;
+    vector<UnsortedCount> buffer;
+    size_t bufferPos = 0;
+    size_t bufferEnd = 0;
+
+    ~UnsortedRun() { close(); }
+
+    /**
+     * create the temporary file of the run to write.
+     */
+    void create() {
+        int fd = makeTempFile(fileName);
+        file = fdopen(fd, "wb");
+        if (file == NULL) {
+            ::close(fd);
+            cerr << "Cannot write temporary file: " << fileName << endl;
+            throw 1;
+        }
+    }
+
+    void write(const UnsortedCount *counts, size_t n) {
+        if (fwrite(counts, sizeof(UnsortedCount), n, file) != n) {
+            cerr << "Cannot write temporary file: " << fileName << endl;
+            throw 1;
+        }
+    }
+
+    /**
+     * close the run after it is written.
+     */
+    void finish() {
+        int status = fclose(file);
+        file = NULL;
+        if (status != 0) {
+            cerr << "Cannot write temporary file: " << fileName << endl;
+            throw 1;
+        }
+    }
+
+    /**
+     * open the run to read, bufferSize counts at a time.
+     */
+    void open(size_t bufferSize) {
+        file = fopen(fileName.c_str(), "rb");
+        if (file == NULL) {
+            cerr << "Cannot open temporary file: " << fileName << endl;
+            throw 1;
+        }
+        buffer.resize(bufferSize);
+        bufferPos = bufferEnd = 0;
+    }
+
+    void close() {
+        if (file != NULL) {
+            fclose(file);
+            file = NULL;
+        }
+        vector<UnsortedCount>().swap(buffer);
+    }
+
+    /**
+     * return false if the run is finished.
+     */
+    bool next(UnsortedCount &count) {
+        if (bufferPos == bufferEnd) {
+            bufferEnd = fread(buffer.data(), sizeof(UnsortedCount),
+                              buffer.size(), file);
+            bufferPos = 0;
+            if (bufferEnd == 0) {
+                if (ferror(file)) {
+                    cerr << "Cannot read temporary file: " << fileName << endl;
+                    throw 1;
+                }
+                return false;
+            }
+        }
+        count = buffer[bufferPos++];
+        return true;
+    }
+};
+
+/**
+ * merge the sorted runs into the counts of each key, in the order of keys.
+ * the runs are opened here and closed when the merge is destroyed.
+ */
+class UnsortedMerge {
+  private:
+    typedef pair<uint64_t, size_t> RunHead; // key and run index.
+    vector<unique_ptr<UnsortedRun>> &runs;
+    priority_queue<RunHead, vector<RunHead>, greater<RunHead>> heads;
+    vector<UnsortedCount> current;
+
+  public:
+    UnsortedMerge(vector<unique_ptr<UnsortedRun>> &runs, size_t bufferSize)
+        : runs(runs), current(runs.size()) {
+        for (size_t i = 0; i < runs.size(); i++) {
+            runs[i]->open(bufferSize);
+            if (runs[i]->next(current[i])) {
+                heads.push(RunHead(current[i].key, i));
+            }
+        }
+    }
+
+    ~UnsortedMerge() {
+        for (size_t i = 0; i < runs.size(); i++) {
+            runs[i]->close();
+        }
+    }
+
+    /**
+     * get the smallest key left with all counts of it. return false if the
+     * runs are finished.
+     */
+    bool next(UnsortedCount &count) {
+        if (heads.empty()) {
+            return false;
+        }
+        count = current[heads.top().second];
+        count.converted = count.unconverted = 0;
+        while (!heads.empty() && heads.top().first == count.key) {
+            size_t i = heads.top().second;
+            heads.pop();
+            count.converted += current[i].converted;
+            count.unconverted += current[i].unconverted;
+            if (runs[i]->next(current[i])) {
+                heads.push(RunHead(current[i].key, i));
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ * count the bases of the alignments in any order. the counts are aggregated in
+ * an open addressing hash table of at most maxMemory bytes. when it is full,
+ * the counts are sorted and spilled to a temporary file as a run. when there
+ * are maxRuns runs, they are merged into one, so the merge never opens more
+ * files. at the end, the runs are merged into the same table as the
+ * sorted input.
+ */
+class UnsortedCounter {
+  private:
+    vector<UnsortedCount> table;
+    uint64_t tableMask;
+    int tableBits;
+    size_t nEntries = 0;
+    size_t maxEntries;
+    size_t maxRuns;       // at most maxUnsortedRuns, within the file limit.
+    size_t runBufferSize; // the counts buffered for each run in the merge.
+    vector<unique_ptr<UnsortedRun>> runs;
+
+    static const uint64_t emptyKey = ~0ULL;
+
+    inline size_t getSlot(uint64_t key) {
+        return (key * 0x9E3779B97F4A7C15ULL) >> (64 - tableBits);
+    }
+
+    /**
+     * move the counts in table to the beginning of it and sort them. return
+     * the number of counts.
+     */
+    size_t sortTable() {
+        size_t n = 0;
+        for (size_t i = 0; i < table.size(); i++) {
+            if (table[i].key != emptyKey) {
+                table[n++] = table[i];
+            }
+        }
+        sort(table.begin(), table.begin() + n,
+             [](const UnsortedCount &a, const UnsortedCount &b) {
+                 return a.key < b.key;
+             });
+        return n;
+    }
+
+    void clearTable() {
+        UnsortedCount empty = {emptyKey, 0, 0};
+        fill(table.begin(), table.end(), empty);
+        nEntries = 0;
+    }
+
+    /**
+     * write the counts in table to a new run.
+     */
+    void spill() {
+        size_t n = sortTable();
+        runs.emplace_back(new UnsortedRun());
+        runs.back()->create();
+        runs.back()->write(table.data(), n);
+        runs.back()->finish();
+        clearTable();
+        if (runs.size() == maxRuns) {
+            mergeRuns();
+        }
+    }
+
+    /**
+     * merge all runs into one.
+     */
+    void mergeRuns() {
+        unique_ptr<UnsortedRun> merged(new UnsortedRun());
+        merged->create();
+        try {
+            UnsortedMerge merge(runs, runBufferSize);
+            vector<UnsortedCount> output(runBufferSize);
+            size_t n = 0;
+            while (merge.next(output[n])) {
+                if (++n == output.size()) {
+                    merged->write(output.data(), n);
+                    n = 0;
+                }
+            }
+            merged->write(output.data(), n);
+            merged->finish();
+        } catch (...) {
+            merged->close();
+            remove(merged->fileName.c_str());
+            throw;
+        }
+        for (size_t i = 0; i < runs.size(); i++) {
+            remove(runs[i]->fileName.c_str());
+        }
+        runs.clear();
+        runs.push_back(move(merged));
+    }
+
+  public:
+    /**
+     * maxMemory is the size of hash table in MB.
+     */
+    UnsortedCounter(long long int maxMemory) {
+        tableBits = 16;
+        while (tableBits < 40 &&
+               (sizeof(UnsortedCount) << (tableBits + 1)) <= (size_t)maxMemory << 20) {
+            tableBits++;
+        }
+        table.resize(1ULL << tableBits);
+        tableMask = table.size() - 1;
+        maxEntries = table.size() / 10 * 7;
+        maxRuns = maxUnsortedRuns;
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+            limit.rlim_cur != RLIM_INFINITY) {
+            size_t files = limit.rlim_cur > reservedFiles + 2
+                               ? limit.rlim_cur - reservedFiles
+                               : 2;
+            maxRuns = min(maxRuns, files);
+        }
+        // the run buffers of a merge take a quarter of the table's memory.
+        runBufferSize = max((size_t)256, table.size() / 4 / maxRuns);
+        clearTable();
+    }
+
+    ~UnsortedCounter() {
+        for (size_t i = 0; i < runs.size(); i++) {
+            remove(runs[i]->fileName.c_str());
+        }
+    }
+
+    /**
+     * count one base at chromosome (id in reference file), 1-based location.
+     */
+    inline void add(int chromosome, long long int location, bool converted) {
+        uint64_t key = ((uint64_t)chromosome << unsortedLocationBits) | location;
+        size_t slot = getSlot(key);
+        while (table[slot].key != key) {
+            if (table[slot].key == emptyKey) {
+                if (nEntries == maxEntries) {
+                    spill();
+                    slot = getSlot(key);
+                    continue;
+                }
+                table[slot].key = key;
+                nEntries++;
+                break;
+            }
+            slot = (slot + 1) & tableMask;
+        }
+        if (converted) {
+            table[slot].converted++;
+        } else {
+            table[slot].unconverted++;
+        }
+    }
+
+    /**
+     * merge the runs (and the table) and output the positions with the
+     * strand in reference, in the order of reference file. the strand is
+     * from the conversion of Policy.
+     */
+    template <typename Policy>
+    void output(ReferenceFile &refFile, ChromosomeFilePositions &chromosomePos,
+                OutputWriter &out) {
+        vector<int> indexOfId(chromosomePos.pos.size());
+        for (size_t i = 0; i < chromosomePos.pos.size(); i++) {
+            indexOfId[chromosomePos.pos[i].id] = i;
+        }
+
+        size_t nTable = sortTable();
+        size_t tablePos = 0;
+        UnsortedMerge merge(runs, runBufferSize);
+        UnsortedCount head; // the next counts from the runs.
+        bool hasHead = merge.next(head);
+
+        int chromosome = -1;
+        const ChromosomeFilePosition *chr = NULL;
+        const char *bases = NULL; // the bases of chr in [basesBegin, basesEnd).
+        long long int basesBegin = 0;
+        long long int basesEnd = 0;
+        while (tablePos < nTable || hasHead) {
+            // take the smallest key, and add all counts of it.
+            UnsortedCount count;
+            if (!hasHead ||
+                (tablePos < nTable && table[tablePos].key <= head.key)) {
+                count = table[tablePos++];
+            } else {
+                count = head;
+                hasHead = merge.next(head);
+            }
+            if (hasHead && head.key == count.key) {
+                count.converted += head.converted;
+                count.unconverted += head.unconverted;
+                hasHead = merge.next(head);
+            }
+
+            int id = count.key >> unsortedLocationBits;
+            long long int location =
+                count.key & ((1ULL << unsortedLocationBits) - 1);
+            if (id != chromosome) {
+                chromosome = id;
+                chr = &chromosomePos.pos[indexOfId[id]];
+                out.setChromosome(id, chr->chromosome);
+                basesBegin = basesEnd = 0;
+            }
+            if (location > chr->length) {
+                continue;
+            }
+            if (location - 1 < basesBegin || location - 1 >= basesEnd) {
+                int n;
+                bases = refFile.getBases(*chr, location - 1, n);
+                basesBegin = location - 1;
+                basesEnd = basesBegin + n;
+            }
+            char base = upperBase(bases[location - 1 - basesBegin]);
+            if (base != Policy::from() && base != Policy::fromComplement()) {
+                continue;
+            }
+            out.writeRow(location, base == Policy::from() ? '+' : '-',
+                         count.converted, count.unconverted);
+        }
+    }
+};
+
+#endif // UNSORTED_3N_TABLE_H
@@ -21,47 +21,87 @@
 #define UTILITY_3N_TABLE_H
 
 #include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
+#include <mutex>
 #include <ostream>
 #include <iostream>
 #include <queue>
 #include <sstream>
+#include <string>
 #include <thread>
+#include <unistd.h>
+#include <vector>
 
 using namespace std;
 
+const int inf = 1234567890;
 const long long int loadingBlockSize = 12000;
-const char convertFrom = 'C';
-const char convertTo = 'T';
-const char convertFromComplement = 'G';
-const char convertToComplement = 'A';
+const int maxCoveredLength = 500000; // the reads cover more are skipped.
 
 
 /**
- * the simple data structure to bind quality score and position (on reference)
- * together.
+ * one counting event produced from an Alignment: the reference offset from the
+ * alignment location and whether the base is converted.
  */
-class PosQuality {
+class PosIncrement {
   public:
-    int readPos; // 0-based
-    int refPos;  // 0-based
-    char qual;
+    int refPos; // 0-based
     bool converted;
-    bool remove;
 
-    PosQuality(int &inputPos) {
-        readPos = inputPos;
-        refPos = inputPos;
-        remove = true;
-    }
-
-    void setQual(char &inputQual, bool inputConverted) {
-        qual = inputQual;
+    PosIncrement(int inputRefPos, bool inputConverted) {
+        refPos = inputRefPos;
         converted = inputConverted;
-        remove = false;
     }
 };
 
+/**
+ * parse the decimal integer in [s, end) without copying it, like stoll.
+ */
+inline long long int parseInteger(const char *s, const char *end) {
+    while (s < end && isspace(*s)) {
+        s++;
+    }
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s == '-';
+        s++;
+    }
+    if (s == end || !isdigit(*s)) {
+        cerr << "Error: " << string(s, end) << " is not an integer." << endl;
+        throw 1;
+    }
+    long long int value = 0;
+    while (s < end && isdigit(*s)) {
+        value = value * 10 + (*s - '0');
+        s++;
+    }
+    return negative ? -value : value;
+}
+
+/**
+ * create a temporary file in TMPDIR (default /tmp). return its file
+ * descriptor, tempFileName is set to its name.
+ */
+inline int makeTempFile(string &tempFileName) {
+    const char *dir = getenv("TMPDIR");
+    string fileName = string(dir != NULL ? dir : "/tmp") +
+                      "/hisat-3n-table.XXXXXX";
+    vector<char> buff(fileName.begin(), fileName.end());
+    buff.push_back('\0');
+    int fd = mkstemp(buff.data());
+    if (fd < 0) {
+        cerr << "Cannot create temporary file: " << fileName << endl;
+        throw 1;
+    }
+    tempFileName = buff.data();
+    return fd;
+}
+
 /**
  * the base class for string we need to search.
  */
@@ -77,9 +117,9 @@ class string_search {
         s.clear();
     }
 
-    void loadString(string intputString) {
-        s = intputString;
-        stringLen = s.size();
+    void loadString(const char *input, int length) {
+        s.assign(input, length);
+        stringLen = length;
         start = 0;
     }
 };
@@ -89,21 +129,72 @@ class string_search {
  */
 class CIGAR : public string_search {
   public:
+    vector<uint32_t> ops; // BAM CIGAR operations (len << 4 | op), if loaded.
+
+    void initialize() {
+        string_search::initialize();
+        ops.clear();
+    }
+
+    void loadString(const char *input, int length) {
+        string_search::loadString(input, length);
+        ops.clear();
+    }
+
+    /**
+     * load the packed CIGAR operations from BAM record.
+     */
+    void loadOps(const char *input, int n) {
+        s.clear();
+        ops.resize(n);
+        memcpy(ops.data(), input, n * sizeof(uint32_t));
+        stringLen = n;
+        start = 0;
+    }
+
+    /**
+     * the bp of reference covered by the operations, with the introns: the
+     * sum of M, D, N, = and X, same as BAMRecord::coveredLength.
+     */
+    long long int getCoveredLength() {
+        long long int length = 0;
+        int len;
+        char symbol;
+        while (getNextSegment(len, symbol)) {
+            if (symbol == 'M' || symbol == 'D' || symbol == 'N' ||
+                symbol == '=' || symbol == 'X') {
+                length += len;
+            }
+        }
+        start = 0;
+        return length;
+    }
+
     bool getNextSegment(int &len, char &symbol) {
         if (start == stringLen) {
             return false;
         }
+        if (!ops.empty()) {
+            len = ops[start] >> 4;
+            symbol = "MIDNSHP=X"[ops[start] & 0xf];
+            start++;
+            return true;
+        }
         len = 0;
         int currentIndex = start;
-        while (true) {
-            if (isalpha(s[currentIndex])) {
-                len = stoi(s.substr(start, currentIndex - start));
+        while (currentIndex < stringLen) {
+            // the operation ends the number, '=' is not a letter.
+            if (isalpha(s[currentIndex]) || s[currentIndex] == '=') {
+                len = (int)parseInteger(s.data() + start,
+                                        s.data() + currentIndex);
                 symbol = s[currentIndex];
                 start = currentIndex + 1;
                 return true;
             }
             currentIndex++;
         }
+        start = stringLen;
+        return false;
     }
 };
 
@@ -112,118 +203,113 @@ class CIGAR : public string_search {
  */
 class MD_tag : public string_search {
   public:
-    bool getNextSegment(string &seg) {
-        if (start >= stringLen) {
-            return false;
-        }
-        seg.clear();
-        int currentIndex = start;
-        bool deletion = false;
+    int matchLeft; // the matched bases left in current number segment.
 
-        while (true) {
-            if (currentIndex >= stringLen) {
-                start = currentIndex + 1;
-                return !seg.empty();
-            }
-            if (seg.empty() && s[currentIndex] == '0') {
-                currentIndex++;
-                continue;
+    void initialize() {
+        string_search::initialize();
+        matchLeft = 0;
+    }
+
+    void loadString(const char *input, int length) {
+        string_search::loadString(input, length);
+        matchLeft = 0;
+    }
+
+    /**
+     * move to the next aligned base of the read. return 1 if the base
+     * matches the reference, 0 if it is a mismatch (refBase is set to the
+     * reference base), -1 if there is no more base in MD tag. deletions do not
+     * cover read bases, so they are skipped.
+     */
+    inline int getNextBase(char &refBase) {
+        while (matchLeft == 0) {
+            if (start >= stringLen) {
+                return -1;
             }
-            if (isalpha(s[currentIndex])) {
-                if (seg.empty()) {
-                    seg = s[currentIndex];
-                    start = currentIndex + 1;
-                    return true;
-                } else {
-                    if (deletion) {
-                        seg += s[currentIndex];
-                        // currentIndex++;
-                    } else {
-                        start = currentIndex;
-                        return true;
-                    }
-                }
-            } else if (s[currentIndex] == '^') {
-                if (seg.empty()) {
-                    seg = s[currentIndex];
-                    deletion = true;
-                } else {
-                    start = currentIndex;
-                    return true;
+            char c = s[start];
+            if (isdigit(c)) {
+                while (start < stringLen && isdigit(s[start])) {
+                    matchLeft = matchLeft * 10 + (s[start] - '0');
+                    start++;
                 }
-            } else { // number
-                if (seg.empty()) {
-                    seg = s[currentIndex];
-                } else {
-                    if (deletion || isalpha(seg.back())) {
-                        start = currentIndex;
-                        return true;
-                    } else {
-                        seg += s[currentIndex];
-                    }
+            } else if (c == '^') {
+                start++;
+                while (start < stringLen && isalpha(s[start])) {
+                    start++;
                 }
+            } else if (isalpha(c)) {
+                refBase = c;
+                start++;
+                return 0;
+            } else {
+                start++;
             }
-            currentIndex++;
         }
+        matchLeft--;
+        return 1;
     }
 };
 
 /**
- * simple safe queue
+ * blocking queue shared by threads. popFront waits until there is a value or
+ * the queue is closed.
  */
-template <typename T> class UnsafeQueue {
+template <typename T> class SafeQueue {
   private:
     queue<T> queue_;
-
-    string getReadName(string *line) {
-        int startPosition = 0;
-        int endPosition;
-
-        endPosition = line->find("\t", startPosition);
-        string readName =
-            line->substr(startPosition, endPosition - startPosition);
-        return readName;
-    }
+    mutex mutex_;
+    condition_variable cond_;
+    bool closed_ = false;
 
   public:
-    int size() {
-
-        int s = queue_.size();
-        return s;
+    void push(T value) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            queue_.push(value);
+        }
+        cond_.notify_one();
     }
 
     /**
-     * return true if the queue is not empty and pop front and get value.
-     * return false if the queue is empty.
+     * return true and pop front to value. return false if the queue is
+     * closed and nothing is left.
      */
     bool popFront(T &value) {
-
-        bool isEmpty = queue_.empty();
-        if (!isEmpty) {
-            value = queue_.front();
-            queue_.pop();
+        unique_lock<mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return !queue_.empty() || closed_; });
+        if (queue_.empty()) {
+            return false;
         }
-        return !isEmpty;
+        value = queue_.front();
+        queue_.pop();
+        return true;
     }
 
-    void push(T value) { queue_.push(value); }
-
-    bool empty() {
-
-        bool check = queue_.empty();
-
-        return check;
+    /**
+     * wake up all waiting threads. no more values will be pushed.
+     */
+    void close() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            closed_ = true;
+        }
+        cond_.notify_all();
     }
 };
 
 /**
- * store one chromosome and it's stream position
+ * store one chromosome and it's position in reference file, same as one line
+ * of .fai file.
  */
 class ChromosomeFilePosition {
   public:
     string chromosome;
-    streampos linePos;
-    ChromosomeFilePosition(string inputChromosome, streampos inputPos) {
+    int id = 0;            // the order in reference file.
+    long long int linePos; // the offset of the first base in file.
+    long long int length = 0;
+    int lineBases = 0;
+    int lineBytes = 0;
+    ChromosomeFilePosition(string inputChromosome, long long int inputPos) {
         chromosome = inputChromosome;
         linePos = inputPos;
     }
@@ -240,49 +326,12 @@ class ChromosomeFilePositions {
   public:
     vector<ChromosomeFilePosition> pos;
 
-    /**
-     * input the chromosome name and it's streamPos, if it is not in pos, add
-     * it.
-     */
-    void append(string &chromosome, streampos &linePos) {
-        pos.push_back(ChromosomeFilePosition(chromosome, linePos));
-    }
-
     const string &getChromesomeString(int index) {
         return pos[index].chromosome;
     }
     /**
-     * make binary search on pos for target chromosome name
-     */
-    int findChromosome(string &targetChromosome, int start, int end) {
-        if (start <= end) {
-            int middle = (start + end) / 2;
-            if (pos[middle].chromosome == targetChromosome) {
-                return middle;
-            }
-            if (pos[middle].chromosome > targetChromosome) {
-                return findChromosome(targetChromosome, start, middle - 1);
-            }
-            return findChromosome(targetChromosome, middle + 1, end);
-        } else {
-            // cannot find the chromosome! throw!
-            cerr << "Cannot find the chromosome: " << targetChromosome
-                 << " in reference file." << endl;
-            throw 1;
-        }
-    }
-
-    /**
-     * given targetChromosome name, return its streampos
-     */
-    streampos getChromosomePosInRefFile(string &targetChromosome) {
-        int index = findChromosome(targetChromosome, 0, pos.size() - 1);
-        // assert(pos[index].chromosome == targetChromosome);
-        return pos[index].linePos;
-    }
-
-    /**
-     * sort the pos by chromosome name
+     * sort the pos by chromosome name. the index in pos is the contig id of
+     * ContigDictionary.
      */
     void sort() { std::sort(pos.begin(), pos.end()); }
 };